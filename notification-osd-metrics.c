@@ -0,0 +1,226 @@
+/*
+ * dumps the metrics files which notification-osd writes with metrics_file=yes.
+ *
+ * usage: notification-osd-metrics [<pid>|<path>...]
+ *
+ * without arguments, every metrics file of a running player in
+ * $XDG_RUNTIME_DIR is dumped.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "notification-osd-metrics.h"
+
+static bool check_header(const char *path, const struct nosd_metrics_header *h,
+        size_t size)
+{
+    if (memcmp(h->magic, NOSD_METRICS_MAGIC, sizeof(h->magic))) {
+        fprintf(stderr, "%s: not a metrics file\n", path);
+        return false;
+    }
+    if (h->version != NOSD_METRICS_VERSION) {
+        fprintf(stderr, "%s: unsupported version %" PRIu32 "\n", path, h->version);
+        return false;
+    }
+
+    uint64_t names_end = h->names_offset +
+        (uint64_t)(h->num_counters + h->num_histograms) * NOSD_METRICS_NAME_LEN;
+    uint64_t counters_end = h->counters_offset +
+        (uint64_t)h->num_counters * sizeof(int64_t);
+    uint64_t histograms_end = h->histograms_offset +
+        (uint64_t)h->num_histograms * h->hist_buckets * sizeof(uint64_t);
+    if (h->size > size || names_end > h->size || counters_end > h->size ||
+            histograms_end > h->size || h->counters_offset % 8 ||
+            h->histograms_offset % 8) {
+        fprintf(stderr, "%s: truncated or corrupt\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static void copy_name(const char *names, uint32_t i, char *buf)
+{
+    memcpy(buf, names + (size_t)i * NOSD_METRICS_NAME_LEN, NOSD_METRICS_NAME_LEN);
+    buf[NOSD_METRICS_NAME_LEN] = '\0';
+}
+
+static bool dump(const char *path, bool quiet)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (!quiet)
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct nosd_metrics_header)) {
+        if (!quiet)
+            fprintf(stderr, "%s: not a metrics file\n", path);
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct nosd_metrics_header h;
+    memcpy(h.magic, map, sizeof(h.magic));
+    atomic_thread_fence(memory_order_acquire);
+    memcpy((char *)&h + sizeof(h.magic), (char *)map + sizeof(h.magic),
+            sizeof(h) - sizeof(h.magic));
+
+    bool ok = check_header(path, &h, st.st_size);
+    if (ok && kill(h.pid, 0) == -1 && errno == ESRCH) {
+        /* left behind by a player which crashed */
+        if (!quiet)
+            fprintf(stderr, "%s: pid %" PRId32 " is gone\n", path, h.pid);
+        ok = false;
+    }
+
+    if (ok) {
+        const char *names = (char *)map + h.names_offset;
+        _Atomic int64_t *counters = (void *)((char *)map + h.counters_offset);
+        _Atomic uint64_t *buckets = (void *)((char *)map + h.histograms_offset);
+        char name[NOSD_METRICS_NAME_LEN + 1];
+
+        printf("# %s (pid %" PRId32 ")\n", path, h.pid);
+        for (uint32_t i = 0; i < h.num_counters; i++) {
+            copy_name(names, i, name);
+            printf("%s %" PRId64 "\n", name,
+                    atomic_load_explicit(&counters[i], memory_order_relaxed));
+        }
+
+        for (uint32_t i = 0; i < h.num_histograms; i++) {
+            copy_name(names, h.num_counters + i, name);
+            printf("%s\n", name);
+            for (uint32_t b = 0; b < h.hist_buckets; b++) {
+                uint64_t count = atomic_load_explicit(
+                        &buckets[(size_t)i * h.hist_buckets + b], memory_order_relaxed);
+                if (!count)
+                    continue;
+                uint64_t lo = b ? UINT64_C(1) << (b - 1) : 0;
+                if (b == h.hist_buckets - 1)
+                    printf("  [%" PRIu64 ", inf) us: %" PRIu64 "\n", lo, count);
+                else
+                    printf("  [%" PRIu64 ", %" PRIu64 ") us: %" PRIu64 "\n", lo,
+                            UINT64_C(1) << b, count);
+            }
+        }
+    }
+
+    munmap(map, st.st_size);
+    return ok;
+}
+
+static int dump_all(void)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir) {
+        fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
+        return 1;
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    int found = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        size_t len = strlen(e->d_name);
+        if (len <= strlen(".metrics") ||
+                strcmp(e->d_name + len - strlen(".metrics"), ".metrics"))
+            continue;
+
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, e->d_name) >= (int)sizeof(path))
+            continue;
+        if (found)
+            printf("\n");
+        if (dump(path, true))
+            found++;
+    }
+    closedir(d);
+
+    if (!found) {
+        fprintf(stderr, "no running player with metrics_file=yes\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int dump_pid(const char *arg)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir) {
+        fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
+        return 1;
+    }
+
+    /* the file is named after the client, which is usually notification_osd */
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%s.metrics", arg);
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    int ret = 1;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        size_t len = strlen(e->d_name);
+        if (len <= strlen(suffix) || strcmp(e->d_name + len - strlen(suffix), suffix))
+            continue;
+
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, e->d_name) >= (int)sizeof(path))
+            continue;
+        if (dump(path, false))
+            ret = 0;
+        break;
+    }
+    closedir(d);
+
+    if (ret)
+        fprintf(stderr, "no metrics file for pid %s\n", arg);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+        return dump_all();
+
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        if (i > 1)
+            printf("\n");
+        if (argv[i][strspn(argv[i], "0123456789")] == '\0')
+            ret |= dump_pid(argv[i]);
+        else
+            ret |= !dump(argv[i], false);
+    }
+    return ret;
+}
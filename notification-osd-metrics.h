@@ -0,0 +1,41 @@
+/*
+ * layout of the metrics file which notification-osd keeps at
+ * $XDG_RUNTIME_DIR/<client>-<pid>.metrics when metrics_file=yes, shared with
+ * the notification-osd-metrics reader.
+ *
+ * the file starts with struct nosd_metrics_header, followed by the names of
+ * the counters and then the histograms (NOSD_METRICS_NAME_LEN bytes each, NUL
+ * padded), the counters (int64_t each) and the histograms (hist_buckets
+ * uint64_t each), at the offsets given in the header. counters and buckets are
+ * written by a single thread with relaxed atomic stores and may be read at any
+ * time with relaxed atomic loads. the magic is written last, once everything
+ * else is in place.
+ *
+ * histogram bucket 0 counts values below 1 µs, bucket i counts values in
+ * [2^(i-1), 2^i) µs, and the last bucket also counts everything above.
+ */
+#ifndef NOTIFICATION_OSD_METRICS_H
+#define NOTIFICATION_OSD_METRICS_H
+
+#include <stdint.h>
+
+#define NOSD_METRICS_MAGIC "mpvnmet"
+#define NOSD_METRICS_VERSION 1
+#define NOSD_METRICS_NAME_LEN 32
+#define NOSD_METRICS_HIST_BUCKETS 24
+
+struct nosd_metrics_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    int32_t pid;
+    uint32_t num_counters;
+    uint32_t num_histograms;
+    uint32_t hist_buckets;
+    uint32_t names_offset;
+    uint32_t counters_offset;
+    uint32_t histograms_offset;
+    uint32_t reserved;
+};
+
+#endif
@@ -19,28 +19,52 @@
 
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <dlfcn.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <malloc.h>
 #include <math.h>
 #include <poll.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <mpv/client.h>
 
-#include <gdk-pixbuf/gdk-pixbuf.h>
 #include <glib.h>
 #include <libnotify/notify.h>
+
+#include "notification-osd-metrics.h"
+
+/* 0 for the lean build, which only uses the built-in scaler */
+#ifndef HAVE_SWSCALE
+#define HAVE_SWSCALE 1
+#endif
+
+#if HAVE_SWSCALE
 #include <libswscale/swscale.h>
+#else
+typedef struct SwsContext SwsContext;
+/* only used as thumbnail_scaling values */
+#define SWS_FAST_BILINEAR 1
+#define SWS_BILINEAR 2
+#define SWS_BICUBIC 4
+#define SWS_LANCZOS 0x200
+#endif
 
 /* D-Bus spec maximum message length is 128 MiB */
 #define MAX_IMAGE_SIZE 127 * 1024 * 1024
@@ -58,6 +82,205 @@ static char body[4096];
 static long pd_thumbnail;
 static long pd_show;
 
+/* 512 KiB of samples */
+#define STRESS_MAX_RTT (1 << 16)
+
+/* state of a stress run, see stress_start() */
+static struct {
+    bool running;
+    bool with_thumbnails;
+    bool force_open_before;
+    int rate;
+    uint64_t updates;
+    uint64_t sends;
+    uint64_t thumbnails;
+    uint64_t superseded;
+    int64_t start_ns;
+    int64_t end_ns;
+    int64_t start_cpu_ns;
+    /*
+     * round trips of notify_notification_show() during the run, the first
+     * STRESS_MAX_RTT of them so the samples stay well within memory_budget
+     */
+    int64_t *rtt_ns;
+    int num_rtt;
+    int max_rtt;
+} stress;
+
+/* stages of the event loop timed by the stall watchdog */
+enum watch_stage {
+    W_EVENTS = 0,
+    W_TIMERS,
+    W_SINK,
+    W_DONE,
+    W_NTF_SHOW,
+    W_NTF_INIT,
+    W_SCALE,
+    W_OSD_QUERY,
+    W_REFINE,
+    W_COMPOSE,
+
+    W_END,
+};
+
+/* subsystems whose memory use is accounted by the memory governor */
+enum mem_account {
+    MEM_THUMBNAIL = 0,
+    MEM_SCALER,
+    MEM_THUMB_CACHE,
+    MEM_THUMB_SHM,
+    MEM_SNAPSHOT,
+    MEM_SINK,
+    MEM_REFINE,
+
+    MEM_END,
+};
+
+/*
+ * counters and timings which are published to user-data/<client>/stats while
+ * perfdata is enabled
+ */
+enum stats_key {
+    S_STARTUP_US = 0,
+    S_NTF_INIT_US,
+    S_NTF_INITS,
+    S_THUMBNAIL_LIBS_LOAD_US,
+    S_SINK_CLIENTS,
+    S_SINK_PUBLISHED,
+    S_SINK_DROPPED,
+    S_THUMB_SHM_PUBLISHED,
+    S_THUMB_REQUESTS,
+    S_THUMB_CACHE_HITS,
+    /* bytes put in the thumbnail cache before and after QOI encoding */
+    S_THUMB_CACHE_RAW,
+    S_THUMB_CACHE_ENCODED,
+    S_THUMB_SERVED,
+    S_PRECAPTURES,
+    S_PRECAPTURE_HITS,
+    S_VISUALIZER_FRAMES,
+    S_VISUALIZER_FRAMES_UNSENT,
+    S_SKIP_BURSTS,
+    S_SKIP_BURST_DEFERRED,
+    S_EQ_APPLIED,
+    S_REFINES,
+    S_REFINES_SENT,
+    S_FOCUS_FLAPS,
+    S_LOG_BATCHES,
+    S_LOG_DROPPED,
+    S_STALLS,
+    S_STALL_MAX_US,
+    /* W_END counters of the stage responsible for each stall */
+    S_STALLS_BY_STAGE,
+    S_EVENT_QUEUE_MAX = S_STALLS_BY_STAGE + W_END,
+    S_EVENT_QUEUE_WARNINGS,
+    S_EVENT_QUEUE_OVERFLOWS,
+    S_MEM_TOTAL,
+    /* MEM_END bytes in use per subsystem */
+    S_MEM_BY_ACCOUNT,
+    S_MEM_EVICTIONS = S_MEM_BY_ACCOUNT + MEM_END,
+    S_MEM_DENIED,
+    S_MEM_TRIMS,
+    S_PLAYBACK_MS,
+    /* the rest are µs of cpu time per minute of playback */
+    S_CPU_USER,
+    S_CPU_SYSTEM,
+    /* W_END counters of the time spent in each stage itself */
+    S_CPU_BY_STAGE,
+
+    S_END = S_CPU_BY_STAGE + W_END,
+};
+
+static const char *stats_names[S_END] = {
+    [S_STARTUP_US] = "startup-us",
+    [S_NTF_INIT_US] = "ntf-init-us",
+    [S_NTF_INITS] = "ntf-inits",
+    [S_THUMBNAIL_LIBS_LOAD_US] = "thumbnail-libs-load-us",
+    [S_SINK_CLIENTS] = "sink-clients",
+    [S_SINK_PUBLISHED] = "sink-published",
+    [S_SINK_DROPPED] = "sink-dropped",
+    [S_THUMB_SHM_PUBLISHED] = "thumb-shm-published",
+    [S_THUMB_REQUESTS] = "thumb-requests",
+    [S_THUMB_CACHE_HITS] = "thumb-cache-hits",
+    [S_THUMB_CACHE_RAW] = "thumb-cache-raw-bytes",
+    [S_THUMB_CACHE_ENCODED] = "thumb-cache-encoded-bytes",
+    [S_THUMB_SERVED] = "thumb-served",
+    [S_PRECAPTURES] = "precaptures",
+    [S_PRECAPTURE_HITS] = "precapture-hits",
+    [S_VISUALIZER_FRAMES] = "visualizer-frames",
+    [S_VISUALIZER_FRAMES_UNSENT] = "visualizer-frames-unsent",
+    [S_SKIP_BURSTS] = "skip-bursts",
+    [S_SKIP_BURST_DEFERRED] = "skip-burst-deferred",
+    [S_EQ_APPLIED] = "eq-applied",
+    [S_REFINES] = "refines",
+    [S_REFINES_SENT] = "refines-sent",
+    [S_FOCUS_FLAPS] = "focus-flaps",
+    [S_LOG_BATCHES] = "log-batches",
+    [S_LOG_DROPPED] = "log-dropped",
+    [S_STALLS] = "stalls",
+    [S_STALL_MAX_US] = "stall-max-us",
+    [S_STALLS_BY_STAGE + W_EVENTS] = "stalls-events",
+    [S_STALLS_BY_STAGE + W_TIMERS] = "stalls-timers",
+    [S_STALLS_BY_STAGE + W_SINK] = "stalls-sink",
+    [S_STALLS_BY_STAGE + W_DONE] = "stalls-done",
+    [S_STALLS_BY_STAGE + W_NTF_SHOW] = "stalls-ntf-show",
+    [S_STALLS_BY_STAGE + W_NTF_INIT] = "stalls-ntf-init",
+    [S_STALLS_BY_STAGE + W_SCALE] = "stalls-scale",
+    [S_STALLS_BY_STAGE + W_OSD_QUERY] = "stalls-osd-query",
+    [S_STALLS_BY_STAGE + W_REFINE] = "stalls-refine",
+    [S_STALLS_BY_STAGE + W_COMPOSE] = "stalls-compose",
+    [S_EVENT_QUEUE_MAX] = "event-queue-max",
+    [S_EVENT_QUEUE_WARNINGS] = "event-queue-warnings",
+    [S_EVENT_QUEUE_OVERFLOWS] = "event-queue-overflows",
+    [S_MEM_TOTAL] = "mem-total",
+    [S_MEM_BY_ACCOUNT + MEM_THUMBNAIL] = "mem-thumbnail",
+    [S_MEM_BY_ACCOUNT + MEM_SCALER] = "mem-scaler",
+    [S_MEM_BY_ACCOUNT + MEM_THUMB_CACHE] = "mem-thumb-cache",
+    [S_MEM_BY_ACCOUNT + MEM_THUMB_SHM] = "mem-thumb-shm",
+    [S_MEM_BY_ACCOUNT + MEM_SNAPSHOT] = "mem-snapshot",
+    [S_MEM_BY_ACCOUNT + MEM_SINK] = "mem-sink",
+    [S_MEM_BY_ACCOUNT + MEM_REFINE] = "mem-refine",
+    [S_MEM_EVICTIONS] = "mem-evictions",
+    [S_MEM_DENIED] = "mem-denied",
+    [S_MEM_TRIMS] = "mem-trims",
+    [S_PLAYBACK_MS] = "playback-ms",
+    [S_CPU_USER] = "cpu-user-us-per-min",
+    [S_CPU_SYSTEM] = "cpu-system-us-per-min",
+    [S_CPU_BY_STAGE + W_EVENTS] = "cpu-events-us-per-min",
+    [S_CPU_BY_STAGE + W_TIMERS] = "cpu-timers-us-per-min",
+    [S_CPU_BY_STAGE + W_SINK] = "cpu-sink-us-per-min",
+    [S_CPU_BY_STAGE + W_DONE] = "cpu-done-us-per-min",
+    [S_CPU_BY_STAGE + W_NTF_SHOW] = "cpu-ntf-show-us-per-min",
+    [S_CPU_BY_STAGE + W_NTF_INIT] = "cpu-ntf-init-us-per-min",
+    [S_CPU_BY_STAGE + W_SCALE] = "cpu-scale-us-per-min",
+    [S_CPU_BY_STAGE + W_OSD_QUERY] = "cpu-osd-query-us-per-min",
+    [S_CPU_BY_STAGE + W_REFINE] = "cpu-refine-us-per-min",
+    [S_CPU_BY_STAGE + W_COMPOSE] = "cpu-compose-us-per-min",
+};
+
+/* latency histograms, in the power of two buckets of notification-osd-metrics.h */
+enum hist_key {
+    H_NTF_SHOW_US = 0,
+    H_SCALE_US,
+    H_LOOP_US,
+
+    H_END,
+};
+
+static const char *hist_names[H_END] = {
+    [H_NTF_SHOW_US] = "ntf-show-us",
+    [H_SCALE_US] = "scale-us",
+    [H_LOOP_US] = "loop-us",
+};
+
+/*
+ * only the plugin thread writes these, but they may be in the metrics file
+ * where other processes read them, hence the relaxed atomics
+ */
+static _Atomic int64_t stats_local[S_END];
+static _Atomic int64_t *stats = stats_local;
+static _Atomic uint64_t hists_local[H_END][NOSD_METRICS_HIST_BUCKETS];
+static _Atomic uint64_t (*hists)[NOSD_METRICS_HIST_BUCKETS] = hists_local;
+
 enum done_action {
     /*
      * a property or event means that the notification should be opened (track
@@ -102,6 +325,11 @@ enum done_action {
      * the image is not enabled.
      */
     A_NTF_CHECK_IMAGE = 1 << 5,
+    /*
+     * the video equalizer has changed. it's applied to the thumbnail by
+     * eq_apply() when possible, otherwise this becomes A_QUEUE_SHOT
+     */
+    A_EQ = 1 << 6,
 };
 
 /*
@@ -115,17 +343,33 @@ static bool ntf_image_enabled;
 /* mark summary/body to be rewritten at the next ntf_upd */
 static bool rewrite_summary;
 static bool rewrite_body;
+/* summary/body were rewritten, but the notification wasn't updated yet */
+static bool text_unsent;
 
 static bool metadata_avail;
 static bool mouse_hovered;
 
 static int64_t UD_SCREENSHOT = 1001;
 static bool screenshot_in_progress;
+/* time-pos when the pending screenshot was queued */
+static double screenshot_time;
+/* the exact time-pos for the thumbnail cache, see thumb_service_time() */
+static double screenshot_time_exact;
+/* time-pos of the frame in the current thumbnail, -1 if none */
+static double thumbnail_time = -1;
 
 static long percent_pos_rounded;
 
 static bool force_open;
 
+/* see skip_burst_update() */
+static struct {
+    int64_t last_change_ns;
+    bool active;
+    /* the thumbnail is of a track that was skipped past, so it isn't sent */
+    bool image_stale;
+} skip_burst;
+
 static char *osd_str_chapter = NULL;
 static char *osd_str_chapters = NULL;
 static char *osd_str_edition = NULL;
@@ -139,10 +383,57 @@ static struct {
     int dst_stride;
     int dst_h;
     uint8_t *thumbnail;
-    GdkPixbuf *pixbuf;
     SwsContext *sws;
+    /* scale with scale_box() instead of sws */
+    bool scale_builtin;
+    /* scale with scale_sample() instead of sws, for batched visualizer frames */
+    bool scale_sample;
 } thumbnail_ctx;
 
+/* a batched visualizer frame is waiting for the next text update to carry it */
+static bool visualizer_frame_unsent;
+
+/*
+ * libswscale (and libavutil through it) is only needed for thumbnails, so it
+ * isn't linked. it's loaded the first time images are enabled, and the
+ * built-in scaler is used if that fails.
+ */
+static struct {
+    bool attempted;
+    bool loaded;
+#if HAVE_SWSCALE
+    void *swscale_lib;
+    __typeof__(&sws_getContext) sws_getContext;
+    __typeof__(&sws_scale) sws_scale;
+    __typeof__(&sws_freeContext) sws_freeContext;
+#endif
+} thumbnail_libs;
+
+/*
+ * what is playing, which selects a profile of overrides for the options in
+ * profiled_opts. these are cheap to switch between since only the thumbnail
+ * context depends on them
+ */
+enum content_class {
+    C_VIDEO = 0,
+    C_AUDIO,
+    C_VISUALIZER,
+    C_GALLERY,
+
+    C_END,
+};
+
+static const char *content_class_names[C_END] = {
+    [C_VIDEO] = "video",
+    [C_AUDIO] = "audio",
+    [C_VISUALIZER] = "visualizer",
+    [C_GALLERY] = "gallery",
+};
+
+static enum content_class content_class;
+
+#define O_PROFILED_LEN 4
+
 enum opts_key {
     O_EXPIRE_TIMEOUT = 0,
     O_NTF_APP_ICON,
@@ -154,11 +445,45 @@ enum opts_key {
     O_THUMBNAIL_SIZE,
     O_SCREENSHOT_FLAGS,
     O_THUMBNAIL_SCALING,
+    O_CAPTURE_INTERVAL,
     O_DISABLE_SCALING,
+    O_WARM_START,
+    O_ARBITRATE,
+    O_STATUS_SOCKET,
+    O_THUMBNAIL_SHM,
+    O_PRECAPTURE,
+    O_VISUALIZER_INTERVAL,
+    O_SKIP_BURST_WINDOW,
+    O_PROGRESSIVE,
+    O_FOCUS_GAIN_DELAY,
+    O_FOCUS_LOSS_DELAY,
+    O_STALL_THRESHOLD,
+    O_MEMORY_BUDGET,
+    O_TRIGGERS,
+    O_METRICS_FILE,
     O_FOCUS_MANUAL,
     O_PERFDATA,
+    /*
+     * <class>.<option> overrides, O_PROFILED_LEN per class in the order of
+     * profiled_opts. MPV_FORMAT_NONE when not set
+     */
+    O_PROFILES,
 
-    O_END,
+    O_END = O_PROFILES + C_END * O_PROFILED_LEN,
+};
+
+static const enum opts_key profiled_opts[O_PROFILED_LEN] = {
+    O_THUMBNAIL_SIZE,
+    O_THUMBNAIL_SCALING,
+    O_SCREENSHOT_FLAGS,
+    O_CAPTURE_INTERVAL,
+};
+
+static const char *profiled_opt_names[O_PROFILED_LEN] = {
+    "thumbnail_size",
+    "thumbnail_scaling",
+    "screenshot_flags",
+    "capture_interval",
 };
 
 /*
@@ -180,7 +505,22 @@ static struct mpv_node opts_defaults[O_END] = {
     [O_THUMBNAIL_SIZE] = {.format = MPV_FORMAT_INT64, .u.int64 = 64},
     [O_SCREENSHOT_FLAGS] = {.format = MPV_FORMAT_STRING, .u.string = "video"},
     [O_THUMBNAIL_SCALING] = {.format = MPV_FORMAT_INT64, .u.int64 = SWS_BICUBIC },
+    [O_CAPTURE_INTERVAL] = {.format = MPV_FORMAT_INT64, .u.int64 = 0},
     [O_DISABLE_SCALING] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
+    [O_WARM_START] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
+    [O_ARBITRATE] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
+    [O_STATUS_SOCKET] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
+    [O_THUMBNAIL_SHM] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
+    [O_PRECAPTURE] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
+    [O_VISUALIZER_INTERVAL] = {.format = MPV_FORMAT_INT64, .u.int64 = 1000},
+    [O_SKIP_BURST_WINDOW] = {.format = MPV_FORMAT_INT64, .u.int64 = 400},
+    [O_PROGRESSIVE] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
+    [O_FOCUS_GAIN_DELAY] = {.format = MPV_FORMAT_INT64, .u.int64 = 100},
+    [O_FOCUS_LOSS_DELAY] = {.format = MPV_FORMAT_INT64, .u.int64 = 300},
+    [O_STALL_THRESHOLD] = {.format = MPV_FORMAT_INT64, .u.int64 = 50},
+    [O_MEMORY_BUDGET] = {.format = MPV_FORMAT_INT64, .u.int64 = 64},
+    [O_TRIGGERS] = {.format = MPV_FORMAT_STRING, .u.string = ""},
+    [O_METRICS_FILE] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
     [O_FOCUS_MANUAL] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
     [O_PERFDATA] = {.format = MPV_FORMAT_FLAG, .u.flag = 0},
 };
@@ -239,6 +579,7 @@ enum observed_prop_userdata {
     P_LOOP_PLAYLIST,
     P_PAUSE,
     P_PAUSED_FOR_CACHE,
+    P_PATH,
     P_PERCENT_POS,
     P_PLAY_DIRECTION,
     P_PLAYLIST_COUNT,
@@ -251,6 +592,7 @@ enum observed_prop_userdata {
     P_TIME_POS,
     P_USER_DATA__DETECT_IMAGE__DETECTED,
     P_VID,
+    P_VIDEO_PARAMS__COLORMATRIX,
     P_VOLUME,
 };
 
@@ -273,13 +615,13 @@ static struct observed_prop observed_props[] = {
     [P_APP_NAME] = {"app-name", MPV_FORMAT_STRING,
         false, A_NTF_UPD},
     [P_BRIGHTNESS] = {"brightness", MPV_FORMAT_INT64,
-        false, A_QUEUE_SHOT},
+        false, A_EQ},
     [P_CHAPTER] = {"chapter", MPV_FORMAT_INT64,
         false, A_NTF_UPD, false, false, true},
     [P_CHAPTERS] = {"chapters", MPV_FORMAT_INT64,
         false, A_NTF_UPD, false, false, true},
     [P_CONTRAST] = {"contrast", MPV_FORMAT_INT64,
-        false, A_QUEUE_SHOT},
+        false, A_EQ},
     [P_CURRENT_TRACKS__VIDEO__IMAGE] = {"current-tracks/video/image", MPV_FORMAT_FLAG},
     [P_DURATION] = {"duration", MPV_FORMAT_INT64,
         false, A_NTF_UPD, false, false, true},
@@ -289,12 +631,12 @@ static struct observed_prop observed_props[] = {
         false, A_NTF_UPD, false, false, true},
     [P_EOF_REACHED] = {"eof-reached", MPV_FORMAT_FLAG,
         false, A_NTF_RST, true, false, true},
-    [P_FOCUSED] = {"focused", MPV_FORMAT_FLAG,
-        false, A_NTF_CLOSE, true},
+    /* closes the notification through focus_update() */
+    [P_FOCUSED] = {"focused", MPV_FORMAT_FLAG},
     [P_GAMMA] = {"gamma", MPV_FORMAT_INT64,
-        false, A_QUEUE_SHOT},
+        false, A_EQ},
     [P_HUE] = {"hue", MPV_FORMAT_INT64,
-        false, A_QUEUE_SHOT},
+        false, A_EQ},
     [P_IDLE_ACTIVE] = {"idle-active", MPV_FORMAT_FLAG,
         false, A_NTF_UPD | A_NTF_CHECK_IMAGE},
     [P_IMAGE_DISPLAY_DURATION] = {"image-display-duration", MPV_FORMAT_DOUBLE,
@@ -320,6 +662,7 @@ static struct observed_prop observed_props[] = {
         false, A_NTF_RST, false, false, true},
     [P_PAUSED_FOR_CACHE] = {"paused-for-cache", MPV_FORMAT_FLAG,
         false, A_NTF_UPD, false, false, true},
+    [P_PATH] = {"path", MPV_FORMAT_STRING},
     [P_PERCENT_POS] = {"percent-pos", MPV_FORMAT_DOUBLE},
     [P_PLAY_DIRECTION] = {"play-direction", MPV_FORMAT_STRING,
         false, A_NTF_UPD, false, false, true},
@@ -328,7 +671,7 @@ static struct observed_prop observed_props[] = {
     [P_PLAYLIST_POS] = {"playlist-pos", MPV_FORMAT_INT64,
         false, A_NTF_UPD, false, false, true},
     [P_SATURATION] = {"saturation", MPV_FORMAT_INT64,
-        false, A_QUEUE_SHOT},
+        false, A_EQ},
     [P_SEEKING] = {"seeking", MPV_FORMAT_FLAG,
         false, A_NTF_UPD, false, false, true},
     [P_SPEED] = {"speed", MPV_FORMAT_DOUBLE,
@@ -344,10 +687,19 @@ static struct observed_prop observed_props[] = {
         false, A_NTF_UPD, false, true},
     [P_VID] = {"vid", MPV_FORMAT_INT64,
         false, A_NTF_UPD | A_NTF_CHECK_IMAGE},
+    /* whether eq_apply() can rotate and scale chroma */
+    [P_VIDEO_PARAMS__COLORMATRIX] = {"video-params/colormatrix", MPV_FORMAT_STRING},
     [P_VOLUME] = {"volume", MPV_FORMAT_INT64,
         false, A_NTF_UPD, false, false, true},
 };
 
+/*
+ * the action masks actually used when a property changes: the ones in
+ * observed_props, with the triggers option applied over them by
+ * triggers_compile()
+ */
+static int prop_actions[sizeof(observed_props) / sizeof(observed_props[0])];
+
 enum log_level {
     LOG_QUIET,
     LOG_ERROR,
@@ -366,12 +718,26 @@ static mpv_handle *hmpv;
 static void ntf_set_progress_bar(void);
 static void ntf_set_urgency(void);
 static void ntf_set_category(void);
+static bool op_true(enum observed_prop_userdata ud);
 static void ntf_set_app_name(void);
 static void ntf_set_app_icon(void);
 static void ntf_set_image(void);
 static void ntf_uninit(void);
 static void ntf_init(void);
 static void thumbnail_ctx_destroy(void);
+static void warm_start_check_path(void);
+static void lease_update(void);
+static void sink_update(void);
+static void thumb_shm_update(void);
+static void thumb_shm_publish(void);
+static void thumb_service_check(void);
+static void thumb_service_reset(void);
+static double thumb_service_time(void);
+static void focus_update(bool immediate);
+static void triggers_compile(void);
+static void metrics_update(void);
+static void visualizer_update(void);
+static void skip_burst_update(void);
 
 static void set_log_level(char *msg_level)
 {
@@ -432,38 +798,301 @@ static const char *log_level_to_str(enum log_level level)
     }
 }
 
-static void logger(const enum log_level level, const char *fmt, ...)
+/*
+ * messages are formatted straight into a batch buffer, one line each, which is
+ * printed with a single async print-text at the end of every loop iteration
+ * instead of a synchronous core command per message. only the plugin thread
+ * logs, so no locking is needed. if the buffer fills up while too many batches
+ * are still in flight, further messages are dropped and counted, and the count
+ * is printed with the next batch.
+ */
+#define LOG_BATCH_SIZE (16 * 1024)
+#define LOG_MAX_LINE 4096
+#define LOG_MAX_INFLIGHT 4
+
+static struct {
+    char buf[LOG_BATCH_SIZE];
+    size_t len;
+    int inflight;
+    uint64_t dropped;
+    uint64_t dropped_total;
+} log_batch;
+
+static int64_t UD_LOG = 1003;
+
+static void log_flush(bool sync);
+
+/* appends a line to the batch, with the level in its prefix unless it's NULL */
+static void log_append(const char *level_str, const char *fmt, va_list ap)
 {
-    if (level > cur_lvl)
+    if (LOG_BATCH_SIZE - log_batch.len < LOG_MAX_LINE)
+        log_flush(false);
+    if (LOG_BATCH_SIZE - log_batch.len < LOG_MAX_LINE) {
+        log_batch.dropped++;
+        log_batch.dropped_total++;
+        return;
+    }
+
+    char *line = log_batch.buf + log_batch.len;
+    size_t count = level_str ?
+        snprintf(line, LOG_MAX_LINE, "%s: %s: ", client_name, level_str) :
+        snprintf(line, LOG_MAX_LINE, "%s: ", client_name);
+    if (count >= LOG_MAX_LINE)
         return;
 
-    char log_buf[4096];
-    size_t log_buf_count = 0;
+    count += vsnprintf(line + count, LOG_MAX_LINE - count, fmt, ap);
 
-    log_buf_count += snprintf(log_buf + log_buf_count,
-            sizeof(log_buf) - log_buf_count, "%s: %s: ",
-            client_name, log_level_to_str(level));
+    /* truncated lines keep their last byte for the newline */
+    count = MIN(count, LOG_MAX_LINE - 1);
+    line[count++] = '\n';
+    log_batch.len += count;
+}
 
-    if (log_buf_count >= sizeof(log_buf))
+static void logger(const enum log_level level, const char *fmt, ...)
+{
+    if (level > cur_lvl)
         return;
 
     va_list ap;
     va_start(ap, fmt);
-    log_buf_count += vsnprintf(log_buf + log_buf_count,
-            sizeof(log_buf) - log_buf_count, fmt, ap);
+    log_append(log_level_to_str(level), fmt, ap);
     va_end(ap);
+}
 
-    mpv_command(hmpv, (const char *[]){"print-text", log_buf, NULL});
+/* output which was explicitly asked for, printed regardless of msg-level */
+static void log_print(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    log_append(NULL, fmt, ap);
+    va_end(ap);
 }
 
-#define ERR(...) logger(LOG_ERROR, __VA_ARGS__)
-#define VERBOSE(...) logger(LOG_VERBOSE, __VA_ARGS__)
-#define DEBUG(...) logger(LOG_DEBUG, __VA_ARGS__)
+/* the level check comes first so that arguments aren't even evaluated */
+#define LOG(level, ...) do { \
+    if ((level) <= cur_lvl) \
+        logger((level), __VA_ARGS__); \
+} while (0)
 
-static void timer_disarm(void)
+#define ERR(...) LOG(LOG_ERROR, __VA_ARGS__)
+#define VERBOSE(...) LOG(LOG_VERBOSE, __VA_ARGS__)
+#define DEBUG(...) LOG(LOG_DEBUG, __VA_ARGS__)
+
+#define NS_PER_SEC 1000000000LL
+#define NS_PER_MS 1000000LL
+
+static int64_t mono_ns(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * NS_PER_SEC + tp.tv_nsec;
+}
+
+static int64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * deadline scheduler multiplexed onto timer_fd, so that all time-based work
+ * shares one wakeup source with the expire timeout.
+ *
+ * timers are kept in a binary min-heap ordered by the latest time they may run
+ * (deadline + slack), and the timerfd is programmed to the root. when it fires,
+ * every timer whose deadline has been reached runs, which is what lets timers
+ * with overlapping slack windows coalesce into a single wakeup. timers are
+ * static objects owned by their subsystem; the heap only holds pointers.
+ */
+struct sched_timer {
+    const char *name;
+    void (*cb)(struct sched_timer *t);
+    /* CLOCK_MONOTONIC ns */
+    int64_t deadline;
+    /* 0 for one-shot timers */
+    int64_t period;
+    int64_t slack;
+    /* periods skipped because the loop was late, for periodic timers */
+    int64_t overruns;
+    /* 1-based position in sched_heap, 0 when not scheduled */
+    int heap_idx;
+};
+
+#define SCHED_MAX 32
+
+static struct sched_timer *sched_heap[SCHED_MAX];
+static int sched_count;
+static int64_t sched_programmed = -1;
+
+static int64_t sched_expiry(struct sched_timer *t)
 {
+    return t->deadline + t->slack;
+}
+
+static void sched_heap_set(int idx, struct sched_timer *t)
+{
+    sched_heap[idx - 1] = t;
+    t->heap_idx = idx;
+}
+
+static void sched_sift_up(int idx)
+{
+    struct sched_timer *t = sched_heap[idx - 1];
+    while (idx > 1) {
+        struct sched_timer *parent = sched_heap[idx / 2 - 1];
+        if (sched_expiry(parent) <= sched_expiry(t))
+            break;
+        sched_heap_set(idx, parent);
+        idx /= 2;
+    }
+    sched_heap_set(idx, t);
+}
+
+static void sched_sift_down(int idx)
+{
+    struct sched_timer *t = sched_heap[idx - 1];
+    while (idx * 2 <= sched_count) {
+        int child = idx * 2;
+        if (child < sched_count && sched_expiry(sched_heap[child]) <
+                sched_expiry(sched_heap[child - 1]))
+            child++;
+        if (sched_expiry(t) <= sched_expiry(sched_heap[child - 1]))
+            break;
+        sched_heap_set(idx, sched_heap[child - 1]);
+        idx = child;
+    }
+    sched_heap_set(idx, t);
+}
+
+/* point the timerfd at the root of the heap, if it isn't already */
+static void sched_program(void)
+{
+    int64_t expiry = sched_count ? sched_expiry(sched_heap[0]) : 0;
+    if (expiry == sched_programmed)
+        return;
+
     struct itimerspec new_value = {0};
-    timerfd_settime(timer_fd, 0, &new_value, 0);
+    if (sched_count) {
+        /* an all-zero it_value would disarm instead of firing immediately */
+        new_value.it_value.tv_sec = expiry / NS_PER_SEC;
+        new_value.it_value.tv_nsec = MAX(expiry % NS_PER_SEC, 1);
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &new_value, NULL);
+    sched_programmed = expiry;
+}
+
+static bool sched_pending(struct sched_timer *t)
+{
+    return t->heap_idx != 0;
+}
+
+static void sched_remove(struct sched_timer *t)
+{
+    int idx = t->heap_idx;
+    struct sched_timer *last = sched_heap[--sched_count];
+    t->heap_idx = 0;
+    if (last == t)
+        return;
+
+    sched_heap_set(idx, last);
+    sched_sift_up(idx);
+    sched_sift_down(last->heap_idx);
+}
+
+static void sched_insert(struct sched_timer *t)
+{
+    if (sched_count == SCHED_MAX)
+        abort();
+
+    sched_heap_set(++sched_count, t);
+    sched_sift_up(sched_count);
+}
+
+static void sched_cancel(struct sched_timer *t)
+{
+    if (!sched_pending(t))
+        return;
+
+    sched_remove(t);
+    sched_program();
+}
+
+/*
+ * (re)schedule a timer to run after delay ns, and then every period ns if
+ * period isn't 0. it may run up to slack ns late so that it can share a wakeup
+ * with other timers.
+ */
+static void sched_add(struct sched_timer *t, int64_t delay, int64_t period,
+        int64_t slack)
+{
+    if (sched_pending(t))
+        sched_remove(t);
+
+    t->deadline = mono_ns() + MAX(delay, 0);
+    t->period = period;
+    t->slack = MAX(slack, 0);
+    t->overruns = 0;
+    sched_insert(t);
+    sched_program();
+}
+
+/* run every timer whose deadline has been reached */
+static void sched_run(void)
+{
+    char drain[4096];
+    (void)!read(timer_fd, drain, sizeof(drain));
+    /* the timerfd was consumed, so it must be programmed again below */
+    sched_programmed = -1;
+
+    int64_t now = mono_ns();
+
+    /*
+     * snapshot the due timers first, since callbacks are allowed to add and
+     * cancel timers (including themselves)
+     */
+    struct sched_timer *due[SCHED_MAX];
+    int due_count = 0;
+    for (int i = 0; i < sched_count; i++) {
+        if (sched_heap[i]->deadline <= now)
+            due[due_count++] = sched_heap[i];
+    }
+
+    for (int i = 0; i < due_count; i++) {
+        struct sched_timer *t = due[i];
+        /* cancelled or rescheduled by an earlier callback */
+        if (!sched_pending(t) || t->deadline > now)
+            continue;
+
+        sched_remove(t);
+        if (t->period) {
+            int64_t missed = (now - t->deadline) / t->period;
+            t->overruns += missed;
+            t->deadline += (missed + 1) * t->period;
+            sched_insert(t);
+        }
+
+        DEBUG("timer %s fired", t->name);
+        t->cb(t);
+    }
+
+    sched_program();
+}
+
+static void on_expire_timer(__attribute__((unused)) struct sched_timer *t)
+{
+    DEBUG("expire timer expired");
+    done_actions |= A_NTF_CLOSE;
+}
+
+static struct sched_timer expire_timer = {
+    .name = "expire",
+    .cb = on_expire_timer,
+};
+
+static void timer_disarm(void)
+{
+    sched_cancel(&expire_timer);
     timer_armed = false;
 }
 
@@ -504,19 +1133,53 @@ static const char *get_replace_str(char c)
     return NULL;
 }
 
+/*
+ * text that's displayed is cut to this many bytes when it's saved. the body
+ * can't hold more anyway, and this keeps multi-megabyte tags (lyrics, base64
+ * blobs) or subtitle lines from being escaped, copied and scanned by snprintf()
+ * in full on every update
+ */
+#define FIELD_MAX_LEN 1024
+
+/* the length of s up to FIELD_MAX_LEN, not cutting a UTF-8 sequence in half */
+static size_t field_len(const char *s)
+{
+    size_t len = strnlen(s, FIELD_MAX_LEN + 1);
+    if (len <= FIELD_MAX_LEN)
+        return len;
+
+    len = FIELD_MAX_LEN;
+    while (len && ((unsigned char)s[len] & 0xc0) == 0x80)
+        len--;
+    return len;
+}
+
+static char *strdupfield(const char *s)
+{
+    return strndup(s, field_len(s));
+}
+
 static char *strdupesc(const char *s)
 {
     if (!server_body_markup)
-        return strdup(s);
+        return strdupfield(s);
+
+    size_t len = field_len(s);
+    size_t size = len + 1;
+    for (size_t i = 0; i < len; i++) {
+        const char *replace = get_replace_str(s[i]);
+        if (replace)
+            size += strlen(replace) - 1;
+    }
 
-    /* if all characters were '&' and became '&amp;' */
-    char *dst = malloc((strlen(s) * 4) + 1);
+    char *dst = malloc(size);
     if (!dst)
         return NULL;
 
     const char *in = s;
+    const char *end = s + len;
     char *out = dst;
-    while (*in) {
+    while (in < end) {
         const char *replace = get_replace_str(*in);
         if (!replace) {
             *out++ = *in++;
@@ -573,1205 +1236,4903 @@ static bool opt_true(enum opts_key opt)
     }
 }
 
-static void opts_copy(struct mpv_node *dst, struct mpv_node *src)
+static int64_t stats_get(enum stats_key key)
 {
-    memcpy(dst, src, sizeof(*dst) * O_END);
-
-    for (int i = 0; i < O_END; i++) {
-        if (src[i].format == MPV_FORMAT_STRING)
-            dst[i].u.string = strdup(src[i].u.string);
-    }
+    return atomic_load_explicit(&stats[key], memory_order_relaxed);
 }
 
-static void opts_destroy(struct mpv_node *o)
+static void stats_publish(void)
 {
-    for (int i = 0; i < O_END; i++) {
-        if (o[i].format == MPV_FORMAT_STRING) {
-            free(o[i].u.string);
-            o[i].u.string = NULL;
-        }
+    char *keys[S_END];
+    mpv_node values[S_END];
+    for (int i = 0; i < S_END; i++) {
+        keys[i] = (char *)stats_names[i];
+        values[i] = (mpv_node){.format = MPV_FORMAT_INT64, .u.int64 = stats_get(i)};
     }
+
+    mpv_node_list list = {.num = S_END, .values = values, .keys = keys};
+    mpv_node node = {.format = MPV_FORMAT_NODE_MAP, .u.list = &list};
+
+    char prop_name[128];
+    snprintf(prop_name, sizeof(prop_name), "user-data/%s/stats", client_name);
+    mpv_set_property_async(hmpv, 0, prop_name, MPV_FORMAT_NODE, &node);
 }
 
-static void opts_run_changed(struct mpv_node *before, struct mpv_node *after)
+static void on_stats_timer(__attribute__((unused)) struct sched_timer *t)
 {
-    for (int i = 0; i < O_END; i++) {
-        bool changed = false;
+    stats_publish();
+}
 
-        switch (before[i].format) {
-            case MPV_FORMAT_STRING:
-                /* strings could technically be null because strdup is allowed
-                 * to fail when copying opts */
-                if ((!before[i].u.string && after[i].u.string) ||
-                        (before[i].u.string && !after[i].u.string)) {
-                    changed = true;
-                    break;
-                }
+static struct sched_timer stats_timer = {
+    .name = "stats",
+    .cb = on_stats_timer,
+};
 
-                changed = strcmp(before[i].u.string, after[i].u.string);
-                break;
-            case MPV_FORMAT_FLAG:
-                changed = before[i].u.flag != after[i].u.flag;
-                break;
-            case MPV_FORMAT_INT64:
-                changed = before[i].u.int64 != after[i].u.int64;
-                break;
-            default:
-                break;
-        }
+/* batch stats changes into at most one publish per second */
+static void stats_changed(void)
+{
+    if (!opt_true(O_PERFDATA) || sched_pending(&stats_timer))
+        return;
 
-        if (changed) {
-            VERBOSE("option %d changed", i);
-            switch (i) {
-                case O_NTF_APP_ICON:
-                    ntf_set_app_icon();
-                    done_actions |= A_NTF_UPD;
-                    break;
-                case O_NTF_CATEGORY:
-                    ntf_set_category();
-                    done_actions |= A_NTF_UPD;
-                    break;
-                case O_NTF_URGENCY:
-                    ntf_set_urgency();
-                    done_actions |= A_NTF_UPD;
-                    break;
-                case O_SEND_THUMBNAIL:
-                    /*
-                     * ntf_check_image doesn't queue thumbnails itself when
-                     * enabling, for reasons described there. if images will be
-                     * enabled then this queue shot will work
-                     */
-                    done_actions |= A_NTF_CHECK_IMAGE;
-                    if (opt_true(O_SEND_THUMBNAIL))
-                        done_actions |= A_QUEUE_SHOT;
-                    break;
-                case O_SEND_PROGRESS:
-                    ntf_set_progress_bar();
-                    done_actions |= A_NTF_UPD;
-                    break;
-                case O_SEND_SUB_TEXT:
-                    done_actions |= A_NTF_UPD;
-                    rewrite_body = true;
-                    break;
-                case O_THUMBNAIL_SIZE:
-                    thumbnail_ctx_destroy();
-                    done_actions |= A_QUEUE_SHOT;
-                    break;
-                case O_SCREENSHOT_FLAGS:
-                    done_actions |= A_QUEUE_SHOT;
-                    break;
-                case O_THUMBNAIL_SCALING:
-                    thumbnail_ctx_destroy();
-                    done_actions |= A_QUEUE_SHOT;
-                    break;
-                case O_DISABLE_SCALING:
-                    thumbnail_ctx_destroy();
-                    done_actions |= A_QUEUE_SHOT;
-                    break;
-                case O_FOCUS_MANUAL:
-                    done_actions |= A_NTF_RST;
-                    break;
-                case O_PERFDATA:
-                    done_actions |= A_NTF_UPD;
-                    rewrite_body = true;
-                    break;
-                default:
-                    break;
-            }
-        }
-    }
+    sched_add(&stats_timer, NS_PER_SEC, 0, NS_PER_SEC / 2);
 }
 
-static bool set_opt_bool(struct mpv_node *o, enum opts_key opt, const char *value)
+static void stats_set(enum stats_key key, int64_t value)
 {
-    if (!strcmp(value, "yes"))
-        o[opt].u.flag = 1;
-    else if (!strcmp(value, "no"))
-        o[opt].u.flag = 0;
-    else
-        return false;
+    if (stats_get(key) == value)
+        return;
 
-    return true;
+    atomic_store_explicit(&stats[key], value, memory_order_relaxed);
+    stats_changed();
 }
 
-static void set_opt_string(struct mpv_node *o, enum opts_key opt,
-        const char *value)
+static void stats_add(enum stats_key key, int64_t delta)
 {
-    free(o[opt].u.string);
-    o[opt].u.string = strdup(value);
+    stats_set(key, stats_get(key) + delta);
 }
 
-/* string options are allowed to be empty strings */
-static void set_opt(struct mpv_node *o, int line_count, const char *key,
-        const char *value)
+static void hist_record(enum hist_key key, int64_t ns)
 {
-    int64_t num_value;
-
-    char *msg_pfx;
-    char msg_pfx_store[64] = {0};
-    if (line_count < 0) {
-        msg_pfx = "script-opts";
-    } else {
-        snprintf(msg_pfx_store, sizeof(msg_pfx_store), "script-opts/%s.conf:%d",
-                client_name, line_count);
-        msg_pfx = msg_pfx_store;
+    int64_t us = ns / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < NOSD_METRICS_HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
     }
 
-    VERBOSE("%s setting option '%s' to '%s'", msg_pfx, key, value);
+    _Atomic uint64_t *b = &hists[key][bucket];
+    atomic_store_explicit(b, atomic_load_explicit(b, memory_order_relaxed) + 1,
+            memory_order_relaxed);
+}
 
-    if (!strcmp(key, "expire_timeout")) {
-        if (!strtolol(value, &num_value) || num_value < 0)
-            goto bad_number;
-        o[O_EXPIRE_TIMEOUT].u.int64 = num_value;
-    } else if (!strcmp(key, "ntf_app_icon")) {
-        set_opt_string(o, O_NTF_APP_ICON, value);
-    } else if (!strcmp(key, "ntf_category")) {
-        set_opt_string(o, O_NTF_CATEGORY, value);
-    } else if (!strcmp(key, "ntf_urgency")) {
-        if (!strcmp(value, "low")) {
-            o[O_NTF_URGENCY].u.int64 = NOTIFY_URGENCY_LOW;
-        } else if (!strcmp(value, "normal")) {
-            o[O_NTF_URGENCY].u.int64 = NOTIFY_URGENCY_NORMAL;
-        } else if (!strcmp(value, "critical")) {
-            o[O_NTF_URGENCY].u.int64 = NOTIFY_URGENCY_CRITICAL;
-        } else {
-            ERR("%s unknown notification urgency '%s', setting to 'low'",
-                    msg_pfx, value);
-            o[O_NTF_URGENCY].u.int64 = NOTIFY_URGENCY_LOW;
-        }
-    } else if (!strcmp(key, "send_thumbnail")) {
-        if (!set_opt_bool(o, O_SEND_THUMBNAIL, value))
-            goto bad_bool;
-    } else if (!strcmp(key, "send_progress")) {
-        if (!set_opt_bool(o, O_SEND_PROGRESS, value))
-            goto bad_bool;
-    } else if (!strcmp(key, "send_sub_text")) {
-        if (!set_opt_bool(o, O_SEND_SUB_TEXT, value))
-            goto bad_bool;
-    } else if (!strcmp(key, "thumbnail_size")) {
-        if (!strtolol(value, &num_value) || num_value < 1)
-            goto bad_number;
-        o[O_THUMBNAIL_SIZE].u.int64 = num_value;
-    } else if (!strcmp(key, "screenshot_flags")) {
-        set_opt_string(o, O_SCREENSHOT_FLAGS, value);
-    } else if (!strcmp(key, "thumbnail_scaling")) {
-        if (!strcmp(value, "fast-bilinear")) {
-            o[O_THUMBNAIL_SCALING].u.int64 = SWS_FAST_BILINEAR;
-        } else if (!strcmp(value, "bilinear")) {
-            o[O_THUMBNAIL_SCALING].u.int64 = SWS_BILINEAR;
-        } else if (!strcmp(value, "bicubic")) {
-            o[O_THUMBNAIL_SCALING].u.int64 = SWS_BICUBIC;
-        } else if (!strcmp(value, "lanczos")) {
-            o[O_THUMBNAIL_SCALING].u.int64 = SWS_LANCZOS;
-        } else {
-            ERR("%s unknown thumbnail scaling option '%s', setting to 'bicubic'",
-                    msg_pfx, value);
-            o[O_THUMBNAIL_SCALING].u.int64 = SWS_BICUBIC;
-        }
-    } else if (!strcmp(key, "disable_scaling")) {
-        if (!set_opt_bool(o, O_DISABLE_SCALING, value))
-            goto bad_bool;
-    } else if (!strcmp(key, "focus_manual")) {
-        if (!set_opt_bool(o, O_FOCUS_MANUAL, value))
-            goto bad_bool;
-    } else if (!strcmp(key, "perfdata")) {
-        if (!set_opt_bool(o, O_PERFDATA, value))
-            goto bad_bool;
-    } else {
-        ERR("%s unknown key '%s', ignoring", msg_pfx, key);
+static void log_flush(bool sync)
+{
+    if (!log_batch.len && !log_batch.dropped)
+        return;
+
+    if (!sync && log_batch.inflight >= LOG_MAX_INFLIGHT)
         return;
+
+    if (log_batch.dropped) {
+        char note[64];
+        int n = snprintf(note, sizeof(note), "%s: %" PRIu64
+                " log messages dropped\n", client_name, log_batch.dropped);
+        if (log_batch.len + n < LOG_BATCH_SIZE) {
+            memcpy(log_batch.buf + log_batch.len, note, n);
+            log_batch.len += n;
+            log_batch.dropped = 0;
+        }
     }
 
-    return;
+    /* print-text adds its own newline */
+    log_batch.buf[log_batch.len - 1] = '\0';
+    const char *args[] = {"print-text", log_batch.buf, NULL};
+    bool sent = false;
+    if (sync)
+        mpv_command(hmpv, args);
+    else if ((sent = mpv_command_async(hmpv, UD_LOG, args) == 0))
+        log_batch.inflight++;
+    log_batch.len = 0;
+
+    /* after the batch is out, since these may log */
+    if (sent) {
+        stats_add(S_LOG_BATCHES, 1);
+        stats_set(S_LOG_DROPPED, log_batch.dropped_total);
+    }
+}
 
-bad_number:
-    ERR("%s error converting value '%s' for key '%s' into number, or number is insuitable, using default or config file value",
-            msg_pfx, value, key);
-    return;
+/*
+ * stall watchdog: each loop iteration is timed, and so are the stages within it
+ * which can block. a stage's own time excludes the stages nested in it. an
+ * iteration taking longer than stall_threshold is counted as a stall of the
+ * stage which took the most time in it
+ */
+static const char *watch_stage_names[W_END] = {
+    [W_EVENTS] = "events",
+    [W_TIMERS] = "timers",
+    [W_SINK] = "sink",
+    [W_DONE] = "done",
+    [W_NTF_SHOW] = "ntf-show",
+    [W_NTF_INIT] = "ntf-init",
+    [W_SCALE] = "scale",
+    [W_OSD_QUERY] = "osd-query",
+    [W_REFINE] = "refine",
+    [W_COMPOSE] = "compose",
+};
 
-bad_bool:
-    ERR("%s error converting value '%s' for key '%s' into boolean, using default or config file value",
-            msg_pfx, value, key);
+#define WATCH_MAX_DEPTH 8
+/* mpv's per-client event queue holds 1000 events */
+#define EVENT_QUEUE_WARN 750
+
+/*
+ * cpu accounting: the thread cpu time of the watch stages, and the thread's
+ * user and system time from getrusage(), are reported every few seconds per
+ * minute of playback (not paused or idle). unlike the wall times of perfdata,
+ * these don't include waiting on D-Bus or mpv. the plugin has no other threads.
+ * it's only done while perfdata or metrics_file is on, and only time spent
+ * during playback is counted.
+ */
+static struct {
+    bool enabled;
+    int64_t playback_ns;
+    int64_t last_ns;
+    bool playing;
+    /* getrusage() times during playback, and the last sample */
+    int64_t user_ns;
+    int64_t system_ns;
+    int64_t ru_user_ns;
+    int64_t ru_system_ns;
+} cpu;
+
+static bool cpu_counting(void)
+{
+    return cpu.enabled && cpu.playing;
 }
 
-static void opts_from_file(struct mpv_node *o)
+static struct {
+    int64_t iter_start;
+    int64_t self_ns[W_END];
+    /* thread cpu time spent in each stage itself, since startup */
+    int64_t cpu_ns[W_END];
+    struct {
+        enum watch_stage stage;
+        int64_t start;
+        int64_t child_ns;
+        /* thread_cpu_ns() is a syscall, so it's only read while counting */
+        bool cpu;
+        int64_t cpu_start;
+        int64_t child_cpu_ns;
+    } stack[WATCH_MAX_DEPTH];
+    int depth;
+} watch;
+
+static void watch_push(enum watch_stage stage)
 {
-    mpv_node path_node = {0};
-    FILE *cfg_file = NULL;
-    char path_to_expand[64];
-    snprintf(path_to_expand, sizeof(path_to_expand), "~~home/script-opts/%s.conf", client_name);
-    const char *args[] = {"expand-path", path_to_expand, NULL};
+    if (watch.depth < WATCH_MAX_DEPTH) {
+        watch.stack[watch.depth].stage = stage;
+        watch.stack[watch.depth].start = mono_ns();
+        watch.stack[watch.depth].child_ns = 0;
+        watch.stack[watch.depth].cpu = cpu_counting();
+        watch.stack[watch.depth].cpu_start =
+            watch.stack[watch.depth].cpu ? thread_cpu_ns() : 0;
+        watch.stack[watch.depth].child_cpu_ns = 0;
+    }
+    watch.depth++;
+}
 
-    if (mpv_command_ret(hmpv, args, &path_node) != 0)
-        goto done;
+static void watch_pop(void)
+{
+    if (--watch.depth >= WATCH_MAX_DEPTH)
+        return;
 
-    if (path_node.format != MPV_FORMAT_STRING)
-        goto done;
+    int64_t elapsed = mono_ns() - watch.stack[watch.depth].start;
+    int64_t cpu_elapsed = watch.stack[watch.depth].cpu ?
+        thread_cpu_ns() - watch.stack[watch.depth].cpu_start : 0;
+    watch.self_ns[watch.stack[watch.depth].stage] +=
+        elapsed - watch.stack[watch.depth].child_ns;
+    watch.cpu_ns[watch.stack[watch.depth].stage] +=
+        cpu_elapsed - watch.stack[watch.depth].child_cpu_ns;
+    if (watch.depth) {
+        watch.stack[watch.depth - 1].child_ns += elapsed;
+        watch.stack[watch.depth - 1].child_cpu_ns += cpu_elapsed;
+    }
+}
 
-    const char *cfg_path = path_node.u.string;
-    cfg_file = fopen(cfg_path, "r");
-    if (!cfg_file)
-        goto done;
+static void watch_iter_begin(void)
+{
+    watch.iter_start = mono_ns();
+    memset(watch.self_ns, 0, sizeof(watch.self_ns));
+}
 
-    char *line = NULL;
-    size_t size;
-    int line_count = 0;
+static int64_t cpu_per_min(int64_t ns)
+{
+    return (double)ns / 1000 * (60.0 * NS_PER_SEC / cpu.playback_ns);
+}
 
-    while (getline(&line, &size, cfg_file) != -1) {
-        char *value;
+/* adds the getrusage() times since the last sample, if they were counted */
+static void cpu_rusage_sample(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_THREAD, &ru) == -1)
+        return;
 
-        line_count++;
+    int64_t user_ns = ru.ru_utime.tv_sec * NS_PER_SEC + ru.ru_utime.tv_usec * 1000;
+    int64_t system_ns = ru.ru_stime.tv_sec * NS_PER_SEC + ru.ru_stime.tv_usec * 1000;
+    if (cpu_counting()) {
+        cpu.user_ns += user_ns - cpu.ru_user_ns;
+        cpu.system_ns += system_ns - cpu.ru_system_ns;
+    }
+    cpu.ru_user_ns = user_ns;
+    cpu.ru_system_ns = system_ns;
+}
 
-        if (!str_is_set(line) || *line == '#' || !(value = strchr(line, '=')))
-            continue;
+static void on_cpu_timer(__attribute__((unused)) struct sched_timer *t)
+{
+    cpu_rusage_sample();
+    stats_set(S_PLAYBACK_MS, cpu.playback_ns / NS_PER_MS);
+    /* too little to extrapolate from */
+    if (cpu.playback_ns < NS_PER_SEC)
+        return;
 
-        size_t line_len = strlen(line);
-        if (line[line_len - 1] == '\n')
-            line[line_len - 1] = '\0';
+    stats_set(S_CPU_USER, cpu_per_min(cpu.user_ns));
+    stats_set(S_CPU_SYSTEM, cpu_per_min(cpu.system_ns));
+    for (int i = 0; i < W_END; i++)
+        stats_set(S_CPU_BY_STAGE + i, cpu_per_min(watch.cpu_ns[i]));
+}
 
-        *value = '\0';
-        value++;
+static struct sched_timer cpu_timer = {
+    .name = "cpu",
+    .cb = on_cpu_timer,
+};
 
-        set_opt(o, line_count, line, value);
-   }
+/* the state can only change with an event, so it's sampled once per iteration */
+static void cpu_account(int64_t now)
+{
+    if (cpu_counting())
+        cpu.playback_ns += now - cpu.last_ns;
+    cpu.last_ns = now;
+
+    bool playing = !op_true(P_PAUSE) && !op_true(P_IDLE_ACTIVE);
+    if (cpu.enabled && playing != cpu.playing)
+        cpu_rusage_sample();
+    cpu.playing = playing;
+}
 
-    free(line);
+static void cpu_update(void)
+{
+    bool enabled = opt_true(O_PERFDATA) || opt_true(O_METRICS_FILE);
+    if (enabled == cpu.enabled)
+        return;
 
-done:
-    if (cfg_file)
-        fclose(cfg_file);
-    mpv_free_node_contents(&path_node);
+    /* counts up to now, or takes the starting sample */
+    cpu_rusage_sample();
+    cpu.last_ns = mono_ns();
+    cpu.enabled = enabled;
+    if (enabled)
+        sched_add(&cpu_timer, 5 * NS_PER_SEC, 5 * NS_PER_SEC, NS_PER_SEC);
+    else
+        sched_cancel(&cpu_timer);
 }
 
-static void opts_from_runtime(struct mpv_node *o, mpv_node *node)
+static void watch_iter_end(void)
 {
-    if (node->format != MPV_FORMAT_NODE_MAP)
+    int64_t threshold = opts[O_STALL_THRESHOLD].u.int64 * NS_PER_MS;
+    int64_t now = mono_ns();
+    int64_t total = now - watch.iter_start;
+    cpu_account(now);
+    hist_record(H_LOOP_US, total);
+    if (!threshold || total < threshold)
         return;
 
-    mpv_node_list *list = node->u.list;
-    for (int i = 0; i < list->num; i++) {
-        char *key = list->keys[i];
-        mpv_node *value = &list->values[i];
+    int worst = 0;
+    for (int i = 1; i < W_END; i++) {
+        if (watch.self_ns[i] > watch.self_ns[worst])
+            worst = i;
+    }
 
-        if (value->format != MPV_FORMAT_STRING)
-            continue;
+    VERBOSE("event loop stalled for %.1f ms, %.1f ms of it in %s",
+            total / 1e6, watch.self_ns[worst] / 1e6, watch_stage_names[worst]);
+    stats_add(S_STALLS, 1);
+    stats_add(S_STALLS_BY_STAGE + worst, 1);
+    if (total / 1000 > stats_get(S_STALL_MAX_US))
+        stats_set(S_STALL_MAX_US, total / 1000);
+}
 
-        char *opt_name = NULL;
+/* called with the number of events drained in one go */
+static void watch_event_queue(int drained)
+{
+    if (drained > stats_get(S_EVENT_QUEUE_MAX))
+        stats_set(S_EVENT_QUEUE_MAX, drained);
 
-        char *str, *token, *saveptr;
-        int j;
+    if (drained >= EVENT_QUEUE_WARN) {
+        ERR("%d events were queued, the event queue is close to overflowing",
+                drained);
+        stats_add(S_EVENT_QUEUE_WARNINGS, 1);
+    }
+}
 
-        bool use_this_opt = false;
-        for (j = 1, str = key; ; j++, str = NULL) {
-            token = strtok_r(str, "-", &saveptr);
-            if (!token)
-                break;
+/*
+ * memory governor: the large allocations of every subsystem are accounted
+ * here and kept within memory_budget. when something needs more, cached
+ * thumbnails are evicted first, largest and least recently used first, and if
+ * that isn't enough the allocation is refused. malloc_trim() is called once
+ * enough has been freed, so that the memory actually goes back to the system.
+ */
+#define MEM_TRIM_THRESHOLD (4 * 1024 * 1024)
 
-            if (j == 1 && !strcmp(token, client_name))
-                use_this_opt = true;
-            else if (j == 2 && use_this_opt)
-                opt_name = strdup(token);
-        }
+static struct {
+    int64_t used[MEM_END];
+    int64_t total;
+    int64_t freed_since_trim;
+    /*
+     * the thumbnail didn't fit in the budget, so no more captures are taken
+     * until the budget, the thumbnail size or the file changes
+     */
+    bool thumbnail_denied;
+} mem;
 
-        if (opt_name && value->u.string)
-            set_opt(o, -1, opt_name, value->u.string);
+static bool thumb_cache_evict(void);
 
-        free(opt_name);
-    }
+static void mem_add(enum mem_account account, int64_t bytes)
+{
+    mem.used[account] += bytes;
+    mem.total += bytes;
+    if (bytes < 0)
+        mem.freed_since_trim -= bytes;
+
+    stats_set(S_MEM_BY_ACCOUNT + account, mem.used[account]);
+    stats_set(S_MEM_TOTAL, mem.total);
 }
 
-static bool op_true(enum observed_prop_userdata ud)
+/* makes room for bytes more, returns false if they don't fit in the budget */
+static bool mem_reserve(int64_t bytes)
 {
-    struct observed_prop *prop = &observed_props[ud];
-    switch (prop->node.format) {
-        case MPV_FORMAT_NONE:
-            return false;
-        case MPV_FORMAT_STRING:
-            return str_is_set(prop->node.u.string);
-        case MPV_FORMAT_FLAG:
-            return prop->node.u.flag;
-        case MPV_FORMAT_INT64:
-            return prop->node.u.int64;
-        default:
+    int64_t budget = opts[O_MEMORY_BUDGET].u.int64 * 1024 * 1024;
+    if (!budget)
+        return true;
+
+    while (mem.total + bytes > budget) {
+        if (!thumb_cache_evict()) {
+            stats_add(S_MEM_DENIED, 1);
             return false;
+        }
+        stats_add(S_MEM_EVICTIONS, 1);
     }
+    return true;
 }
 
-static bool op_avail(enum observed_prop_userdata ud)
+/* called between loop iterations rather than in the middle of freeing */
+static void mem_maybe_trim(void)
 {
-    struct observed_prop *prop = &observed_props[ud];
-    return prop->node.format != MPV_FORMAT_NONE;
+    if (mem.freed_since_trim < MEM_TRIM_THRESHOLD)
+        return;
+
+    mem.freed_since_trim = 0;
+#ifdef __GLIBC__
+    malloc_trim(0);
+    stats_add(S_MEM_TRIMS, 1);
+#endif
 }
 
-static void get_osd_str_chapter(void)
+static void opts_copy(struct mpv_node *dst, struct mpv_node *src)
 {
-    free(osd_str_chapter);
-    osd_str_chapter = NULL;
-    mpv_free(osd_str_chapters);
-    osd_str_chapters = NULL;
-    char *tmp = osd_str_chapter = mpv_get_property_osd_string(hmpv, "chapter");
-    if (!tmp)
-        return;
-    osd_str_chapter = strdupesc(tmp);
-    mpv_free(tmp);
-    osd_str_chapters = mpv_get_property_osd_string(hmpv, "chapters");
+    memcpy(dst, src, sizeof(*dst) * O_END);
+
+    for (int i = 0; i < O_END; i++) {
+        if (src[i].format == MPV_FORMAT_STRING)
+            dst[i].u.string = strdup(src[i].u.string);
+    }
 }
 
-static void get_osd_str_edition(void)
+static void opts_destroy(struct mpv_node *o)
 {
-    free(osd_str_edition);
-    osd_str_edition = NULL;
-    mpv_free(osd_str_editions);
-    osd_str_editions = NULL;
-    char *tmp = mpv_get_property_osd_string(hmpv, "edition");
-    if (!tmp)
-        return;
-    osd_str_edition = strdupesc(tmp);
-    mpv_free(tmp);
-    osd_str_editions = mpv_get_property_osd_string(hmpv, "editions");
+    for (int i = 0; i < O_END; i++) {
+        if (o[i].format == MPV_FORMAT_STRING) {
+            free(o[i].u.string);
+            o[i].u.string = NULL;
+        }
+    }
 }
 
-static void save_prop(mpv_event *event, struct observed_prop *prop)
+/* the returned node may be a profile override for the current content class */
+static struct mpv_node *opt_node(enum opts_key opt)
 {
-    mpv_event_property *event_prop = event->data;
+    for (int k = 0; k < O_PROFILED_LEN; k++) {
+        if (profiled_opts[k] != opt)
+            continue;
 
-    if (prop->node.format == MPV_FORMAT_STRING)
-        free(prop->node.u.string);
+        struct mpv_node *o =
+            &opts[O_PROFILES + content_class * O_PROFILED_LEN + k];
+        if (o->format != MPV_FORMAT_NONE)
+            return o;
+        break;
+    }
 
-    prop->node.format = event_prop->format;
+    return &opts[opt];
+}
 
-    switch (event_prop->format) {
-        case MPV_FORMAT_STRING:
-            prop->node.u.string = prop->string_needs_escaping ?
-                strdupesc(*(char **)event_prop->data) :
-                strdup(*(char **)event_prop->data);
+static bool opt_node_equal(struct mpv_node *a, struct mpv_node *b)
+{
+    if (a->format == MPV_FORMAT_STRING)
+        return !strcmp(a->u.string ? a->u.string : "",
+                b->u.string ? b->u.string : "");
+    return a->u.int64 == b->u.int64;
+}
+
+static void opt_changed(int i)
+{
+    switch (i) {
+        case O_NTF_APP_ICON:
+            ntf_set_app_icon();
+            done_actions |= A_NTF_UPD;
             break;
-        case MPV_FORMAT_FLAG:
-            prop->node.u.flag = *(int *)event_prop->data;
+        case O_NTF_CATEGORY:
+            ntf_set_category();
+            done_actions |= A_NTF_UPD;
             break;
-        case MPV_FORMAT_INT64:
-            prop->node.u.int64 = *(int64_t *)event_prop->data;
+        case O_NTF_URGENCY:
+            ntf_set_urgency();
+            done_actions |= A_NTF_UPD;
             break;
-        case MPV_FORMAT_DOUBLE:
-            prop->node.u.double_ = *(double *)event_prop->data;
+        case O_SEND_THUMBNAIL:
+            /*
+             * ntf_check_image doesn't queue thumbnails itself when
+             * enabling, for reasons described there. if images will be
+             * enabled then this queue shot will work
+             */
+            done_actions |= A_NTF_CHECK_IMAGE;
+            if (opt_true(O_SEND_THUMBNAIL))
+                done_actions |= A_QUEUE_SHOT;
+            break;
+        case O_SEND_PROGRESS:
+            ntf_set_progress_bar();
+            done_actions |= A_NTF_UPD;
+            break;
+        case O_SEND_SUB_TEXT:
+            done_actions |= A_NTF_UPD;
+            rewrite_body = true;
+            break;
+        case O_THUMBNAIL_SIZE:
+            thumbnail_ctx_destroy();
+            mem.thumbnail_denied = false;
+            done_actions |= A_QUEUE_SHOT;
+            break;
+        case O_SCREENSHOT_FLAGS:
+            thumbnail_time = -1;
+            done_actions |= A_QUEUE_SHOT;
+            break;
+        case O_THUMBNAIL_SCALING:
+            thumbnail_ctx_destroy();
+            done_actions |= A_QUEUE_SHOT;
+            break;
+        case O_CAPTURE_INTERVAL:
+            break;
+        case O_VISUALIZER_INTERVAL:
+            /* the scaler differs when batching */
+            thumbnail_ctx_destroy();
+            visualizer_update();
+            done_actions |= A_QUEUE_SHOT;
+            break;
+        case O_DISABLE_SCALING:
+            thumbnail_ctx_destroy();
+            mem.thumbnail_denied = false;
+            done_actions |= A_QUEUE_SHOT;
+            break;
+        case O_ARBITRATE:
+            lease_update();
+            break;
+        case O_STATUS_SOCKET:
+            sink_update();
+            break;
+        case O_THUMBNAIL_SHM:
+            thumb_shm_update();
+            break;
+        case O_TRIGGERS:
+            triggers_compile();
+            break;
+        case O_METRICS_FILE:
+            metrics_update();
+            cpu_update();
+            break;
+        case O_MEMORY_BUDGET:
+            /* evicts down to a lowered budget */
+            mem_reserve(0);
+            mem.thumbnail_denied = false;
+            done_actions |= A_QUEUE_SHOT;
+            break;
+        case O_FOCUS_MANUAL:
+            focus_update(true);
+            done_actions |= A_NTF_RST;
+            break;
+        case O_PERFDATA:
+            done_actions |= A_NTF_UPD;
+            rewrite_body = true;
+            stats_changed();
+            cpu_update();
             break;
-        case MPV_FORMAT_NONE:
-        case MPV_FORMAT_NODE:
         default:
-            prop->node = (struct mpv_node){0};
+            /* an override only matters for the current class */
+            if (i >= O_PROFILES &&
+                    (i - O_PROFILES) / O_PROFILED_LEN == (int)content_class)
+                opt_changed(profiled_opts[(i - O_PROFILES) % O_PROFILED_LEN]);
+            break;
+    }
+}
+
+static void opts_run_changed(struct mpv_node *before, struct mpv_node *after)
+{
+    for (int i = 0; i < O_END; i++) {
+        bool changed = false;
+
+        /* profile overrides come and go */
+        if (before[i].format != after[i].format) {
+            changed = true;
+        } else switch (before[i].format) {
+            case MPV_FORMAT_STRING:
+                /* strings could technically be null because strdup is allowed
+                 * to fail when copying opts */
+                if ((!before[i].u.string && after[i].u.string) ||
+                        (before[i].u.string && !after[i].u.string)) {
+                    changed = true;
+                    break;
+                }
+
+                changed = strcmp(before[i].u.string, after[i].u.string);
+                break;
+            case MPV_FORMAT_FLAG:
+                changed = before[i].u.flag != after[i].u.flag;
+                break;
+            case MPV_FORMAT_INT64:
+                changed = before[i].u.int64 != after[i].u.int64;
+                break;
+            default:
+                break;
+        }
+
+        if (changed) {
+            VERBOSE("option %d changed", i);
+            opt_changed(i);
+        }
+    }
+}
+
+static bool set_opt_bool(struct mpv_node *o, enum opts_key opt, const char *value)
+{
+    if (!strcmp(value, "yes"))
+        o[opt].u.flag = 1;
+    else if (!strcmp(value, "no"))
+        o[opt].u.flag = 0;
+    else
+        return false;
+
+    return true;
+}
+
+static void set_opt_string(struct mpv_node *o, enum opts_key opt,
+        const char *value)
+{
+    free(o[opt].u.string);
+    o[opt].u.string = strdup(value);
+}
+
+static bool set_opt_profiled(struct mpv_node *o, int line_count,
+        const char *key, const char *value);
+
+/*
+ * string options are allowed to be empty strings. returns false if the option
+ * wasn't set
+ */
+static bool set_opt(struct mpv_node *o, int line_count, const char *key,
+        const char *value)
+{
+    int64_t num_value;
+
+    char *msg_pfx;
+    char msg_pfx_store[64] = {0};
+    if (line_count < 0) {
+        msg_pfx = "script-opts";
+    } else {
+        snprintf(msg_pfx_store, sizeof(msg_pfx_store), "script-opts/%s.conf:%d",
+                client_name, line_count);
+        msg_pfx = msg_pfx_store;
+    }
+
+    VERBOSE("%s setting option '%s' to '%s'", msg_pfx, key, value);
+
+    if (strchr(key, '.')) {
+        return set_opt_profiled(o, line_count, key, value);
+    } else if (!strcmp(key, "expire_timeout")) {
+        if (!strtolol(value, &num_value) || num_value < 0)
+            goto bad_number;
+        o[O_EXPIRE_TIMEOUT].u.int64 = num_value;
+    } else if (!strcmp(key, "ntf_app_icon")) {
+        set_opt_string(o, O_NTF_APP_ICON, value);
+    } else if (!strcmp(key, "ntf_category")) {
+        set_opt_string(o, O_NTF_CATEGORY, value);
+    } else if (!strcmp(key, "ntf_urgency")) {
+        if (!strcmp(value, "low")) {
+            o[O_NTF_URGENCY].u.int64 = NOTIFY_URGENCY_LOW;
+        } else if (!strcmp(value, "normal")) {
+            o[O_NTF_URGENCY].u.int64 = NOTIFY_URGENCY_NORMAL;
+        } else if (!strcmp(value, "critical")) {
+            o[O_NTF_URGENCY].u.int64 = NOTIFY_URGENCY_CRITICAL;
+        } else {
+            ERR("%s unknown notification urgency '%s', setting to 'low'",
+                    msg_pfx, value);
+            o[O_NTF_URGENCY].u.int64 = NOTIFY_URGENCY_LOW;
+        }
+    } else if (!strcmp(key, "send_thumbnail")) {
+        if (!set_opt_bool(o, O_SEND_THUMBNAIL, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "send_progress")) {
+        if (!set_opt_bool(o, O_SEND_PROGRESS, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "send_sub_text")) {
+        if (!set_opt_bool(o, O_SEND_SUB_TEXT, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "thumbnail_size")) {
+        if (!strtolol(value, &num_value) || num_value < 1)
+            goto bad_number;
+        o[O_THUMBNAIL_SIZE].u.int64 = num_value;
+    } else if (!strcmp(key, "screenshot_flags")) {
+        set_opt_string(o, O_SCREENSHOT_FLAGS, value);
+    } else if (!strcmp(key, "thumbnail_scaling")) {
+        if (!strcmp(value, "fast-bilinear")) {
+            o[O_THUMBNAIL_SCALING].u.int64 = SWS_FAST_BILINEAR;
+        } else if (!strcmp(value, "bilinear")) {
+            o[O_THUMBNAIL_SCALING].u.int64 = SWS_BILINEAR;
+        } else if (!strcmp(value, "bicubic")) {
+            o[O_THUMBNAIL_SCALING].u.int64 = SWS_BICUBIC;
+        } else if (!strcmp(value, "lanczos")) {
+            o[O_THUMBNAIL_SCALING].u.int64 = SWS_LANCZOS;
+        } else {
+            ERR("%s unknown thumbnail scaling option '%s', setting to 'bicubic'",
+                    msg_pfx, value);
+            o[O_THUMBNAIL_SCALING].u.int64 = SWS_BICUBIC;
+        }
+    } else if (!strcmp(key, "capture_interval")) {
+        if (!strtolol(value, &num_value) || num_value < 0)
+            goto bad_number;
+        o[O_CAPTURE_INTERVAL].u.int64 = num_value;
+    } else if (!strcmp(key, "disable_scaling")) {
+        if (!set_opt_bool(o, O_DISABLE_SCALING, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "warm_start")) {
+        if (!set_opt_bool(o, O_WARM_START, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "arbitrate")) {
+        if (!set_opt_bool(o, O_ARBITRATE, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "status_socket")) {
+        if (!set_opt_bool(o, O_STATUS_SOCKET, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "thumbnail_shm")) {
+        if (!set_opt_bool(o, O_THUMBNAIL_SHM, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "precapture")) {
+        if (!set_opt_bool(o, O_PRECAPTURE, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "visualizer_interval")) {
+        if (!strtolol(value, &num_value) || num_value < 0)
+            goto bad_number;
+        o[O_VISUALIZER_INTERVAL].u.int64 = num_value;
+    } else if (!strcmp(key, "skip_burst_window")) {
+        if (!strtolol(value, &num_value) || num_value < 0)
+            goto bad_number;
+        o[O_SKIP_BURST_WINDOW].u.int64 = num_value;
+    } else if (!strcmp(key, "progressive")) {
+        if (!set_opt_bool(o, O_PROGRESSIVE, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "focus_gain_delay")) {
+        if (!strtolol(value, &num_value) || num_value < 0)
+            goto bad_number;
+        o[O_FOCUS_GAIN_DELAY].u.int64 = num_value;
+    } else if (!strcmp(key, "focus_loss_delay")) {
+        if (!strtolol(value, &num_value) || num_value < 0)
+            goto bad_number;
+        o[O_FOCUS_LOSS_DELAY].u.int64 = num_value;
+    } else if (!strcmp(key, "stall_threshold")) {
+        if (!strtolol(value, &num_value) || num_value < 0)
+            goto bad_number;
+        o[O_STALL_THRESHOLD].u.int64 = num_value;
+    } else if (!strcmp(key, "memory_budget")) {
+        if (!strtolol(value, &num_value) || num_value < 0)
+            goto bad_number;
+        o[O_MEMORY_BUDGET].u.int64 = num_value;
+    } else if (!strcmp(key, "triggers")) {
+        set_opt_string(o, O_TRIGGERS, value);
+    } else if (!strcmp(key, "metrics_file")) {
+        if (!set_opt_bool(o, O_METRICS_FILE, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "focus_manual")) {
+        if (!set_opt_bool(o, O_FOCUS_MANUAL, value))
+            goto bad_bool;
+    } else if (!strcmp(key, "perfdata")) {
+        if (!set_opt_bool(o, O_PERFDATA, value))
+            goto bad_bool;
+    } else {
+        ERR("%s unknown key '%s', ignoring", msg_pfx, key);
+        return false;
+    }
+
+    return true;
+
+bad_number:
+    ERR("%s error converting value '%s' for key '%s' into number, or number is insuitable, using default or config file value",
+            msg_pfx, value, key);
+    return false;
+
+bad_bool:
+    ERR("%s error converting value '%s' for key '%s' into boolean, using default or config file value",
+            msg_pfx, value, key);
+    return false;
+}
+
+/* <class>.<option>, parsed like <option> into a scratch copy */
+static bool set_opt_profiled(struct mpv_node *o, int line_count,
+        const char *key, const char *value)
+{
+    const char *dot = strchr(key, '.');
+    int c, k;
+    for (c = 0; c < C_END; c++) {
+        if (strlen(content_class_names[c]) == (size_t)(dot - key) &&
+                !strncmp(key, content_class_names[c], dot - key))
+            break;
+    }
+    for (k = 0; k < O_PROFILED_LEN; k++) {
+        if (!strcmp(dot + 1, profiled_opt_names[k]))
             break;
     }
+
+    if (c == C_END || k == O_PROFILED_LEN) {
+        ERR("unknown profile option '%s', ignoring", key);
+        return false;
+    }
+
+    enum opts_key opt = profiled_opts[k];
+    struct mpv_node scratch[O_END] = {0};
+    scratch[opt].format = opts_defaults[opt].format;
+    if (!set_opt(scratch, line_count, dot + 1, value)) {
+        free(scratch[opt].format == MPV_FORMAT_STRING ?
+                scratch[opt].u.string : NULL);
+        return false;
+    }
+
+    struct mpv_node *slot = &o[O_PROFILES + c * O_PROFILED_LEN + k];
+    if (slot->format == MPV_FORMAT_STRING)
+        free(slot->u.string);
+    *slot = scratch[opt];
+    return true;
+}
+
+static void opts_from_file(struct mpv_node *o)
+{
+    mpv_node path_node = {0};
+    FILE *cfg_file = NULL;
+    char path_to_expand[64];
+    snprintf(path_to_expand, sizeof(path_to_expand), "~~home/script-opts/%s.conf", client_name);
+    const char *args[] = {"expand-path", path_to_expand, NULL};
+
+    if (mpv_command_ret(hmpv, args, &path_node) != 0)
+        goto done;
+
+    if (path_node.format != MPV_FORMAT_STRING)
+        goto done;
+
+    const char *cfg_path = path_node.u.string;
+    cfg_file = fopen(cfg_path, "r");
+    if (!cfg_file)
+        goto done;
+
+    char *line = NULL;
+    size_t size;
+    int line_count = 0;
+
+    while (getline(&line, &size, cfg_file) != -1) {
+        char *value;
+
+        line_count++;
+
+        if (!str_is_set(line) || *line == '#' || !(value = strchr(line, '=')))
+            continue;
+
+        size_t line_len = strlen(line);
+        if (line[line_len - 1] == '\n')
+            line[line_len - 1] = '\0';
+
+        *value = '\0';
+        value++;
+
+        set_opt(o, line_count, line, value);
+   }
+
+    free(line);
+
+done:
+    if (cfg_file)
+        fclose(cfg_file);
+    mpv_free_node_contents(&path_node);
+}
+
+static void opts_from_runtime(struct mpv_node *o, mpv_node *node)
+{
+    if (node->format != MPV_FORMAT_NODE_MAP)
+        return;
+
+    mpv_node_list *list = node->u.list;
+    for (int i = 0; i < list->num; i++) {
+        char *key = list->keys[i];
+        mpv_node *value = &list->values[i];
+
+        if (value->format != MPV_FORMAT_STRING)
+            continue;
+
+        char *opt_name = NULL;
+
+        char *str, *token, *saveptr;
+        int j;
+
+        bool use_this_opt = false;
+        for (j = 1, str = key; ; j++, str = NULL) {
+            token = strtok_r(str, "-", &saveptr);
+            if (!token)
+                break;
+
+            if (j == 1 && !strcmp(token, client_name))
+                use_this_opt = true;
+            else if (j == 2 && use_this_opt)
+                opt_name = strdup(token);
+        }
+
+        if (opt_name && value->u.string)
+            set_opt(o, -1, opt_name, value->u.string);
+
+        free(opt_name);
+    }
+}
+
+static bool op_true(enum observed_prop_userdata ud)
+{
+    struct observed_prop *prop = &observed_props[ud];
+    switch (prop->node.format) {
+        case MPV_FORMAT_NONE:
+            return false;
+        case MPV_FORMAT_STRING:
+            return str_is_set(prop->node.u.string);
+        case MPV_FORMAT_FLAG:
+            return prop->node.u.flag;
+        case MPV_FORMAT_INT64:
+            return prop->node.u.int64;
+        default:
+            return false;
+    }
+}
+
+static bool op_avail(enum observed_prop_userdata ud)
+{
+    struct observed_prop *prop = &observed_props[ud];
+    return prop->node.format != MPV_FORMAT_NONE;
+}
+
+static const struct {
+    const char *name;
+    int action;
+} trigger_actions[] = {
+    {"none", 0},
+    {"rst", A_NTF_RST},
+    {"upd", A_NTF_UPD},
+    {"close", A_NTF_CLOSE},
+    {"shot", A_QUEUE_SHOT},
+    {"forced-shot", A_FORCED_QUEUE_SHOT},
+    {"check-image", A_NTF_CHECK_IMAGE},
+    {"eq", A_EQ},
+};
+
+/*
+ * parses the triggers option, a space separated list of
+ * <property>:<action>[+<action>...], into prop_actions. this only happens when
+ * the option changes, so property changes stay a single mask lookup
+ */
+static void triggers_compile(void)
+{
+    for (size_t i = 0; i < sizeof(observed_props) / sizeof(observed_props[0]); i++)
+        prop_actions[i] = observed_props[i].action;
+
+    if (!opt_true(O_TRIGGERS))
+        return;
+
+    char *spec = strdup(opts[O_TRIGGERS].u.string);
+    if (!spec)
+        return;
+
+    char *saveptr1, *saveptr2;
+    for (char *entry = strtok_r(spec, " ", &saveptr1); entry;
+            entry = strtok_r(NULL, " ", &saveptr1)) {
+        char *acts = strchr(entry, ':');
+        if (!acts) {
+            ERR("trigger '%s' has no actions, ignoring", entry);
+            continue;
+        }
+        *acts++ = '\0';
+
+        size_t prop;
+        for (prop = 0; prop < sizeof(observed_props) / sizeof(observed_props[0]); prop++) {
+            if (!strcmp(observed_props[prop].name, entry))
+                break;
+        }
+        if (prop == sizeof(observed_props) / sizeof(observed_props[0])) {
+            ERR("trigger for unknown property '%s', ignoring", entry);
+            continue;
+        }
+
+        int action = 0;
+        bool valid = true;
+        for (char *act = strtok_r(acts, "+", &saveptr2); act && valid;
+                act = strtok_r(NULL, "+", &saveptr2)) {
+            size_t a;
+            for (a = 0; a < sizeof(trigger_actions) / sizeof(trigger_actions[0]); a++) {
+                if (!strcmp(trigger_actions[a].name, act))
+                    break;
+            }
+            if (a == sizeof(trigger_actions) / sizeof(trigger_actions[0])) {
+                ERR("unknown trigger action '%s' for '%s', ignoring", act, entry);
+                valid = false;
+            } else {
+                action |= trigger_actions[a].action;
+            }
+        }
+
+        if (valid) {
+            VERBOSE("trigger for %s set to %#x", entry, action);
+            prop_actions[prop] = action;
+        }
+    }
+
+    free(spec);
+}
+
+/*
+ * switching runs the same actions as opts_run_changed() would for the options
+ * whose effective value differs between the two profiles
+ */
+static void content_class_update(void)
+{
+    enum content_class c;
+    if (op_true(P_USER_DATA__DETECT_IMAGE__DETECTED))
+        c = C_GALLERY;
+    else if (op_true(P_LAVFI_COMPLEX))
+        c = C_VISUALIZER;
+    else if (op_true(P_CURRENT_TRACKS__VIDEO__IMAGE) || !op_avail(P_VID))
+        c = C_AUDIO;
+    else
+        c = C_VIDEO;
+
+    if (c == content_class)
+        return;
+
+    struct mpv_node *before[O_PROFILED_LEN];
+    for (int k = 0; k < O_PROFILED_LEN; k++)
+        before[k] = opt_node(profiled_opts[k]);
+
+    VERBOSE("content class changed to %s", content_class_names[c]);
+    bool visualizer_changed = (c == C_VISUALIZER) != (content_class == C_VISUALIZER);
+    content_class = c;
+    if (visualizer_changed) {
+        /* the scaler differs when batching */
+        thumbnail_ctx_destroy();
+        visualizer_update();
+        done_actions |= A_QUEUE_SHOT;
+    }
+
+    for (int k = 0; k < O_PROFILED_LEN; k++) {
+        if (!opt_node_equal(before[k], opt_node(profiled_opts[k])))
+            opt_changed(profiled_opts[k]);
+    }
+}
+
+/* see visualizer_update() */
+static bool visualizer_batched(void)
+{
+    return content_class == C_VISUALIZER && opts[O_VISUALIZER_INTERVAL].u.int64;
+}
+
+static void get_osd_str_chapter(void)
+{
+    free(osd_str_chapter);
+    osd_str_chapter = NULL;
+    mpv_free(osd_str_chapters);
+    osd_str_chapters = NULL;
+    char *tmp = osd_str_chapter = mpv_get_property_osd_string(hmpv, "chapter");
+    if (!tmp)
+        return;
+    osd_str_chapter = strdupesc(tmp);
+    mpv_free(tmp);
+    osd_str_chapters = mpv_get_property_osd_string(hmpv, "chapters");
+}
+
+static void get_osd_str_edition(void)
+{
+    free(osd_str_edition);
+    osd_str_edition = NULL;
+    mpv_free(osd_str_editions);
+    osd_str_editions = NULL;
+    char *tmp = mpv_get_property_osd_string(hmpv, "edition");
+    if (!tmp)
+        return;
+    osd_str_edition = strdupesc(tmp);
+    mpv_free(tmp);
+    osd_str_editions = mpv_get_property_osd_string(hmpv, "editions");
+}
+
+static void save_prop(mpv_event *event, struct observed_prop *prop)
+{
+    mpv_event_property *event_prop = event->data;
+
+    if (prop->node.format == MPV_FORMAT_STRING)
+        free(prop->node.u.string);
+
+    prop->node.format = event_prop->format;
+
+    switch (event_prop->format) {
+        case MPV_FORMAT_STRING:
+            if (prop->string_needs_escaping)
+                prop->node.u.string = strdupesc(*(char **)event_prop->data);
+            else if (prop->part_of_summary || prop->part_of_body)
+                prop->node.u.string = strdupfield(*(char **)event_prop->data);
+            else
+                prop->node.u.string = strdup(*(char **)event_prop->data);
+            break;
+        case MPV_FORMAT_FLAG:
+            prop->node.u.flag = *(int *)event_prop->data;
+            break;
+        case MPV_FORMAT_INT64:
+            prop->node.u.int64 = *(int64_t *)event_prop->data;
+            break;
+        case MPV_FORMAT_DOUBLE:
+            prop->node.u.double_ = *(double *)event_prop->data;
+            break;
+        case MPV_FORMAT_NONE:
+        case MPV_FORMAT_NODE:
+        default:
+            prop->node = (struct mpv_node){0};
+            break;
+    }
+}
+
+static bool mouse_is_hovered(mpv_event_property *event_prop)
+{
+    if (event_prop->format != MPV_FORMAT_NODE)
+        return false;
+
+    struct mpv_node *node = event_prop->data;
+
+    if (node->format != MPV_FORMAT_NODE_MAP)
+        return false;
+
+    mpv_node_list *list = node->u.list;
+    for (int i = 0; i < list->num; i++) {
+        char *key = list->keys[i];
+        mpv_node *value = &list->values[i];
+
+        if (value->format != MPV_FORMAT_FLAG)
+            continue;
+
+        if (!strcmp(key, "hover"))
+            return value->u.flag;
+    }
+
+    return false;
+}
+
+static bool player_focused_now(void)
+{
+    return (op_true(P_FOCUSED) || mouse_hovered || opt_true(O_FOCUS_MANUAL));
+}
+
+/* debounced by focus_update() */
+static bool player_focused;
+
+/*
+ * the first value of each is settled right away: the window may already be
+ * focused at startup, and the notification shouldn't open over it meanwhile
+ */
+static bool focused_observed;
+static bool mouse_pos_observed;
+
+static bool player_considered_focused(void)
+{
+    return player_focused;
+}
+
+static void metadata_destroy(void)
+{
+    for (size_t i = 0; i < sizeof(metadata) / sizeof(metadata[0]); i++) {
+        if (metadata[i]) {
+            free(metadata[i]);
+            metadata[i] = NULL;
+        }
+    }
+}
+
+static void metadata_update(mpv_event_property *event_prop)
+{
+    metadata_destroy();
+    metadata_avail = false;
+
+    if (event_prop->format != MPV_FORMAT_NODE)
+        return;
+
+    struct mpv_node *node = event_prop->data;
+
+    if (node->format != MPV_FORMAT_NODE_MAP)
+        return;
+
+    metadata_avail = true;
+
+    mpv_node_list *list = node->u.list;
+    for (int i = 0; i < list->num; i++) {
+        char *key = list->keys[i];
+        mpv_node *value = &list->values[i];
+
+        if (value->format != MPV_FORMAT_STRING)
+            continue;
+
+        if (!strcasecmp(key, "album")) {
+            if (!metadata[M_ALBUM])
+                metadata[M_ALBUM] = strdupesc(value->u.string);
+        } else if (!strcasecmp(key, "album_artist")) {
+            if (!metadata[M_ALBUM_ARTIST])
+                metadata[M_ALBUM_ARTIST] = strdupesc(value->u.string);
+        } else if (!strcasecmp(key, "artist")) {
+            if (!metadata[M_ARTIST])
+                metadata[M_ARTIST] = strdupfield(value->u.string);
+            if (!metadata[M_ARTIST__ESC])
+                metadata[M_ARTIST__ESC] = strdupesc(value->u.string);
+        } else if (!strcasecmp(key, "date")) {
+            if (!metadata[M_DATE])
+                metadata[M_DATE] = strdupesc(value->u.string);
+            if (!metadata[M_DATE__YEAREXT])
+                metadata[M_DATE__YEAREXT] = strdupescyear(value->u.string);
+        } else if (!strcasecmp(key, "disc")) {
+            if (!metadata[M_DISC])
+                metadata[M_DISC] = strdupesc(value->u.string);
+        } else if (!strcasecmp(key, "discc")) {
+            if (!metadata[M_DISCC])
+                metadata[M_DISCC] = strdupesc(value->u.string);
+        } else if (!strcasecmp(key, "discnumber")) {
+            if (!metadata[M_DISCNUMBER])
+                metadata[M_DISCNUMBER] = strdupesc(value->u.string);
+        } else if (!strcasecmp(key, "disctotal")) {
+            if (!metadata[M_DISCTOTAL])
+                metadata[M_DISCTOTAL] = strdupesc(value->u.string);
+        } else if (!strcasecmp(key, "originaldate")) {
+            if (!metadata[M_ORIGINALDATE])
+                metadata[M_ORIGINALDATE] = strdupesc(value->u.string);
+            if (!metadata[M_ORIGINALDATE__YEAREXT])
+                metadata[M_ORIGINALDATE__YEAREXT] = strdupescyear(value->u.string);
+        } else if (!strcasecmp(key, "originalyear")) {
+            if (!metadata[M_ORIGINALYEAR])
+                metadata[M_ORIGINALYEAR] = strdupesc(value->u.string);
+        } else if (!strcasecmp(key, "title")) {
+            if (!metadata[M_TITLE])
+                metadata[M_TITLE] = strdupfield(value->u.string);
+        } else if (!strcasecmp(key, "totaldiscs")) {
+            if (!metadata[M_TOTALDISCS])
+                metadata[M_TOTALDISCS] = strdupesc(value->u.string);
+        } else if (!strcasecmp(key, "year")) {
+            if (!metadata[M_YEAR])
+                metadata[M_YEAR] = strdupesc(value->u.string);
+        }
+    }
+}
+
+static void on_property_change(mpv_event *event)
+{
+    mpv_event_property *event_prop = event->data;
+    struct observed_prop *prop = &observed_props[event->reply_userdata];
+
+    save_prop(event, prop);
+
+    int action = prop_actions[event->reply_userdata];
+    if (!prop->action_if_true || op_true(event->reply_userdata))
+        done_actions |= action;
+
+    /* e.g. video equalizer changes, which the frame doesn't show yet */
+    if (action & A_QUEUE_SHOT)
+        thumbnail_time = -1;
+
+    if (prop->part_of_summary)
+        rewrite_summary = true;
+    if (prop->part_of_body)
+        rewrite_body = true;
+
+    switch (event->reply_userdata) {
+        case P_APP_NAME:
+            ntf_set_app_name();
+            break;
+        case P_CHAPTER:
+        case P_CHAPTERS:
+            watch_push(W_OSD_QUERY);
+            get_osd_str_chapter();
+            watch_pop();
+            break;
+        case P_EDITION:
+        case P_EDITIONS:
+            watch_push(W_OSD_QUERY);
+            get_osd_str_edition();
+            watch_pop();
+            break;
+        case P_IDLE_ACTIVE:
+            ntf_set_progress_bar();
+            rewrite_body = true;
+            break;
+        case P_METADATA:
+            metadata_update(event_prop);
+            break;
+        case P_MOUSE_POS:
+            mouse_hovered = mouse_is_hovered(event_prop);
+            focus_update(!mouse_pos_observed);
+            mouse_pos_observed = true;
+            break;
+        case P_FOCUSED:
+            focus_update(!focused_observed);
+            focused_observed = true;
+            break;
+        case P_MSG_LEVEL:
+            set_log_level(observed_props[P_MSG_LEVEL].node.u.string);
+            break;
+        case P_OPTIONS_SCRIPT_OPTS: {
+            struct mpv_node opts_previous[O_END] = {0};
+            opts_copy(opts_previous, opts);
+            opts_destroy(opts);
+            opts_copy(opts, opts_base);
+            if (event_prop->format == MPV_FORMAT_NODE)
+                opts_from_runtime(opts, event_prop->data);
+            opts_run_changed(opts_previous, opts);
+            opts_destroy(opts_previous);
+            break;
+        }
+        case P_PERCENT_POS: {
+            /*
+             * avoid constantly queueing screenshots for cover art. that means
+             * we have to make sure we otherwise detect if the image has changed
+             * (e.g. equalizer options), which probably won't be perfect.
+             * a batched visualizer is captured by visualizer_timer instead
+             */
+            if (!op_true(P_CURRENT_TRACKS__VIDEO__IMAGE) && !visualizer_batched())
+                done_actions |= A_QUEUE_SHOT;
+
+            long old_rounded = percent_pos_rounded;
+            if (op_avail(P_PERCENT_POS) && isnormal(observed_props[P_PERCENT_POS].node.u.double_))
+                percent_pos_rounded = lround(observed_props[P_PERCENT_POS].node.u.double_);
+            else
+                percent_pos_rounded = 0;
+
+            if (old_rounded != percent_pos_rounded) {
+                ntf_set_progress_bar();
+                done_actions |= A_NTF_UPD;
+                rewrite_body = true;
+            }
+            break;
+        }
+        case P_CURRENT_TRACKS__VIDEO__IMAGE:
+        case P_LAVFI_COMPLEX:
+        case P_VID:
+            /* see ntf_check_image, the class is unknown while switching */
+            if (op_true(P_IDLE_ACTIVE) || op_avail(P_VID) || metadata_avail)
+                content_class_update();
+            break;
+        case P_PATH:
+            warm_start_check_path();
+            thumb_service_reset();
+            thumbnail_time = -1;
+            mem.thumbnail_denied = false;
+            break;
+        case P_PLAYLIST_COUNT:
+            ntf_set_progress_bar();
+            break;
+        case P_PLAYLIST_POS:
+            ntf_set_progress_bar();
+            skip_burst_update();
+            break;
+        case P_TIME_POS:
+            thumb_service_check();
+            break;
+        case P_USER_DATA__DETECT_IMAGE__DETECTED:
+            ntf_set_progress_bar();
+            content_class_update();
+            break;
+        default:
+            break;
+    }
+
+    DEBUG("property changed, %s.", prop->name);
+}
+
+#if HAVE_SWSCALE
+static void *thumbnail_libs_sym(void *lib, const char *symbol)
+{
+    void *sym = dlsym(lib, symbol);
+    if (!sym)
+        ERR("failed to resolve %s: %s", symbol, dlerror());
+    return sym;
+}
+#endif
+
+static void thumbnail_libs_unload(void)
+{
+#if HAVE_SWSCALE
+    if (thumbnail_libs.swscale_lib)
+        dlclose(thumbnail_libs.swscale_lib);
+#endif
+
+    bool attempted = thumbnail_libs.attempted;
+    memset(&thumbnail_libs, 0, sizeof(thumbnail_libs));
+    thumbnail_libs.attempted = attempted;
+}
+
+/* returns whether libswscale is usable, only trying to load it once */
+static bool thumbnail_libs_load(void)
+{
+    if (thumbnail_libs.attempted)
+        return thumbnail_libs.loaded;
+
+    thumbnail_libs.attempted = true;
+
+#if HAVE_SWSCALE
+    int64_t start = mono_ns();
+    const char *filename = "libswscale.so." AV_STRINGIFY(LIBSWSCALE_VERSION_MAJOR);
+
+    if (!(thumbnail_libs.swscale_lib = dlopen(filename, RTLD_NOW | RTLD_LOCAL))) {
+        ERR("failed to load %s: %s", filename, dlerror());
+        goto fail;
+    }
+
+    /* the casts go through void * to avoid warnings about object pointers */
+    if (!(*(void **)&thumbnail_libs.sws_getContext = thumbnail_libs_sym(
+                    thumbnail_libs.swscale_lib, "sws_getContext")))
+        goto fail;
+    if (!(*(void **)&thumbnail_libs.sws_scale = thumbnail_libs_sym(
+                    thumbnail_libs.swscale_lib, "sws_scale")))
+        goto fail;
+    if (!(*(void **)&thumbnail_libs.sws_freeContext = thumbnail_libs_sym(
+                    thumbnail_libs.swscale_lib, "sws_freeContext")))
+        goto fail;
+
+    thumbnail_libs.loaded = true;
+    stats_set(S_THUMBNAIL_LIBS_LOAD_US, (mono_ns() - start) / 1000);
+    VERBOSE("loaded libswscale");
+    return true;
+
+fail:
+    ERR("libswscale unavailable, using the built-in scaler");
+    thumbnail_libs_unload();
+#endif
+    return false;
+}
+
+/*
+ * built-in area averaging scaler, for the lean build or when libswscale can't
+ * be loaded. every output pixel is the mean of the source pixels it covers,
+ * which holds up well for the large ratios thumbnails are downscaled by.
+ */
+static void scale_box(const uint8_t *src, int src_w, int src_h, int src_stride,
+        uint8_t *dst, int dst_w, int dst_h, int dst_stride)
+{
+    for (int y = 0; y < dst_h; y++) {
+        int y0 = (int64_t)y * src_h / dst_h;
+        int y1 = MAX(y0 + 1, (int64_t)(y + 1) * src_h / dst_h);
+        uint8_t *out = dst + (size_t)y * dst_stride;
+
+        for (int x = 0; x < dst_w; x++) {
+            int x0 = (int64_t)x * src_w / dst_w;
+            int x1 = MAX(x0 + 1, (int64_t)(x + 1) * src_w / dst_w);
+            uint64_t sum[4] = {0};
+
+            for (int sy = y0; sy < y1; sy++) {
+                const uint8_t *in = src + (size_t)sy * src_stride + x0 * 4;
+                for (int sx = x0; sx < x1; sx++, in += 4) {
+                    sum[0] += in[0];
+                    sum[1] += in[1];
+                    sum[2] += in[2];
+                    sum[3] += in[3];
+                }
+            }
+
+            uint64_t count = (uint64_t)(y1 - y0) * (x1 - x0);
+            for (int c = 0; c < 4; c++)
+                out[x * 4 + c] = (sum[c] + count / 2) / count;
+        }
+    }
+}
+
+/*
+ * fast scaler for batched visualizer frames: every output pixel is the mean of
+ * four source pixels at fixed points inside the area it covers, so the cost
+ * only depends on the thumbnail size and not on the size of the video output.
+ * it aliases on fine detail, which doesn't matter for a visualizer.
+ */
+static void scale_sample(const uint8_t *src, int src_w, int src_h, int src_stride,
+        uint8_t *dst, int dst_w, int dst_h, int dst_stride)
+{
+    for (int y = 0; y < dst_h; y++) {
+        const uint8_t *row0 = src +
+            (size_t)((int64_t)(4 * y + 1) * src_h / (4 * dst_h)) * src_stride;
+        const uint8_t *row1 = src +
+            (size_t)((int64_t)(4 * y + 3) * src_h / (4 * dst_h)) * src_stride;
+        uint8_t *out = dst + (size_t)y * dst_stride;
+
+        for (int x = 0; x < dst_w; x++) {
+            size_t x0 = (size_t)((int64_t)(4 * x + 1) * src_w / (4 * dst_w)) * 4;
+            size_t x1 = (size_t)((int64_t)(4 * x + 3) * src_w / (4 * dst_w)) * 4;
+            for (int c = 0; c < 4; c++)
+                out[x * 4 + c] = (row0[x0 + c] + row0[x1 + c] +
+                        row1[x0 + c] + row1[x1 + c] + 2) >> 2;
+        }
+    }
+}
+
+/* libswscale's filter coefficients and line buffers scale with the widths */
+static int64_t sws_cost_estimate(void)
+{
+    return (int64_t)(thumbnail_ctx.src_w + thumbnail_ctx.dst_w) * 64;
+}
+
+/*
+ * video equalizer on the thumbnail: the last scaled capture is kept as a base,
+ * together with the equalizer values it was taken with. a change of
+ * brightness, contrast, gamma, hue or saturation is then applied to the base
+ * here instead of reading back a new frame, approximating mpv's equalizer as
+ *
+ *   out = gamma(contrast * M * in + brightness),
+ *   M = ycbcr_to_rgb * eq * rgb_to_ycbcr
+ *
+ * with hue rotating and saturation scaling chroma, contrast scaling the whole
+ * output range, brightness offsetting it and gamma raising to 1/8^(gamma/100).
+ * mpv only applies hue and saturation to ycbcr sources, so for rgb sources and
+ * cover art a change of those is captured again instead. the base
+ * already has its own equalizer values applied, so those are undone first:
+ * the whole change is a lut, a 3x4 matrix and another lut per pixel.
+ */
+enum eq_key {
+    EQ_BRIGHTNESS = 0,
+    EQ_CONTRAST,
+    EQ_GAMMA,
+    EQ_HUE,
+    EQ_SATURATION,
+
+    EQ_END,
+};
+
+static const enum observed_prop_userdata eq_props[EQ_END] = {
+    [EQ_BRIGHTNESS] = P_BRIGHTNESS,
+    [EQ_CONTRAST] = P_CONTRAST,
+    [EQ_GAMMA] = P_GAMMA,
+    [EQ_HUE] = P_HUE,
+    [EQ_SATURATION] = P_SATURATION,
+};
+
+static struct {
+    uint8_t *base;
+    size_t size;
+    int64_t base_values[EQ_END];
+    /* the values when the pending screenshot was queued */
+    int64_t shot_values[EQ_END];
+    bool shot_valid;
+} eq;
+
+static bool eq_values(int64_t values[EQ_END])
+{
+    for (int i = 0; i < EQ_END; i++) {
+        if (!op_avail(eq_props[i]))
+            return false;
+        values[i] = observed_props[eq_props[i]].node.u.int64;
+    }
+    return true;
+}
+
+/* the rgb to rgb matrix of the equalizer values, in 3x4 row major order */
+static void eq_matrix(const int64_t values[EQ_END], double m[3][4])
+{
+    /* bt.709 */
+    static const double kr = 0.2126, kb = 0.0722, kg = 1 - kr - kb;
+    static const double to_ycc[3][3] = {
+        {kr, kg, kb},
+        {-kr / (2 * (1 - kb)), -kg / (2 * (1 - kb)), 0.5},
+        {0.5, -kg / (2 * (1 - kr)), -kb / (2 * (1 - kr))},
+    };
+    static const double to_rgb[3][3] = {
+        {1, 0, 2 * (1 - kr)},
+        {1, -2 * kb * (1 - kb) / kg, -2 * kr * (1 - kr) / kg},
+        {1, 2 * (1 - kb), 0},
+    };
+
+    double contrast = (values[EQ_CONTRAST] + 100) / 100.0;
+    double brightness = values[EQ_BRIGHTNESS] / 100.0;
+    double saturation = (values[EQ_SATURATION] + 100) / 100.0;
+    double hue = values[EQ_HUE] / 100.0 * M_PI;
+    const double adjust[3][3] = {
+        {1, 0, 0},
+        {0, saturation * cos(hue), -saturation * sin(hue)},
+        {0, saturation * sin(hue), saturation * cos(hue)},
+    };
+
+    double tmp[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            tmp[i][j] = 0;
+            for (int k = 0; k < 3; k++)
+                tmp[i][j] += adjust[i][k] * to_ycc[k][j];
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m[i][j] = 0;
+            for (int k = 0; k < 3; k++)
+                m[i][j] += to_rgb[i][k] * tmp[k][j];
+            m[i][j] *= contrast;
+        }
+        /* the offset is 0 before contrast, which it's scaled by like mpv does */
+        m[i][3] = brightness;
+    }
+}
+
+/* whether mpv applies hue and saturation to the current video */
+static bool eq_source_ycbcr(void)
+{
+    if (op_true(P_CURRENT_TRACKS__VIDEO__IMAGE) ||
+            !op_avail(P_VIDEO_PARAMS__COLORMATRIX))
+        return false;
+
+    const char *matrix = observed_props[P_VIDEO_PARAMS__COLORMATRIX].node.u.string;
+    return strcmp(matrix, "rgb") && strcmp(matrix, "xyz");
+}
+
+static bool eq_matrix_invert(double m[3][4], double inv[3][4])
+{
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+        m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+        m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    /* contrast or saturation at -100 loses what would be needed */
+    if (fabs(det) < 1e-6)
+        return false;
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int i1 = (j + 1) % 3, i2 = (j + 2) % 3;
+            int j1 = (i + 1) % 3, j2 = (i + 2) % 3;
+            inv[i][j] = (m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1]) / det;
+        }
+    }
+    for (int i = 0; i < 3; i++)
+        inv[i][3] = -(inv[i][0] * m[0][3] + inv[i][1] * m[1][3] + inv[i][2] * m[2][3]);
+    return true;
+}
+
+static void eq_free(void)
+{
+    if (!eq.base)
+        return;
+
+    mem_add(MEM_THUMBNAIL, -(int64_t)eq.size);
+    free(eq.base);
+    eq.base = NULL;
+}
+
+/*
+ * redo the thumbnail from the base with the current equalizer values. returns
+ * false if that isn't possible, and a new screenshot is needed
+ */
+static bool eq_apply(void)
+{
+    int64_t now[EQ_END];
+    if (!eq.base || !thumbnail_ctx.thumbnail || !eq_values(now))
+        return false;
+    if (!memcmp(now, eq.base_values, sizeof(now))) {
+        memcpy(thumbnail_ctx.thumbnail, eq.base, eq.size);
+        return true;
+    }
+    if (!eq_source_ycbcr() && (now[EQ_HUE] != eq.base_values[EQ_HUE] ||
+                now[EQ_SATURATION] != eq.base_values[EQ_SATURATION]))
+        return false;
+
+    double m_base[3][4], m_base_inv[3][4], m_now[3][4];
+    eq_matrix(eq.base_values, m_base);
+    eq_matrix(now, m_now);
+    if (!eq_matrix_invert(m_base, m_base_inv))
+        return false;
+
+    int64_t start = mono_ns();
+
+    /* m_now * m_base_inv in 20.12 fixed point, with the offsets in 0-255 */
+    int32_t m[3][4];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            double v = 0;
+            for (int k = 0; k < 3; k++)
+                v += m_now[i][k] * m_base_inv[k][j];
+            if (j == 3)
+                v = (v + m_now[i][3]) * 255;
+            m[i][j] = lround(v * 4096);
+        }
+    }
+
+    double gamma_base = exp(log(8.0) * eq.base_values[EQ_GAMMA] / 100.0);
+    double gamma_now = exp(log(8.0) * now[EQ_GAMMA] / 100.0);
+    uint8_t lut_in[256], lut_out[256];
+    for (int i = 0; i < 256; i++) {
+        lut_in[i] = lround(pow(i / 255.0, gamma_base) * 255);
+        lut_out[i] = lround(pow(i / 255.0, 1 / gamma_now) * 255);
+    }
+
+    /* plain integer math so that the compiler can vectorize the rows */
+    for (int y = 0; y < thumbnail_ctx.dst_h; y++) {
+        const uint8_t *in = eq.base + (size_t)y * thumbnail_ctx.dst_stride;
+        uint8_t *out = thumbnail_ctx.thumbnail + (size_t)y * thumbnail_ctx.dst_stride;
+
+        for (int x = 0; x < thumbnail_ctx.dst_w; x++, in += 4, out += 4) {
+            int32_t r = lut_in[in[0]], g = lut_in[in[1]], b = lut_in[in[2]];
+            for (int c = 0; c < 3; c++) {
+                int32_t v = (m[c][0] * r + m[c][1] * g + m[c][2] * b + m[c][3] +
+                        2048) >> 12;
+                out[c] = lut_out[v < 0 ? 0 : v > 255 ? 255 : v];
+            }
+            out[3] = in[3];
+        }
+    }
+
+    stats_add(S_EQ_APPLIED, 1);
+    DEBUG("applied equalizer to the thumbnail in %" PRId64 " us",
+            (mono_ns() - start) / 1000);
+    return true;
+}
+
+/* keep the thumbnail that was just scaled as the base */
+static void eq_store(void)
+{
+    size_t size = (size_t)thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h;
+    if (!eq.shot_valid || (eq.base && eq.size != size))
+        eq_free();
+    if (!eq.shot_valid)
+        return;
+
+    if (!eq.base) {
+        /* without a base, equalizer changes are captured again */
+        if (!mem_reserve(size) || !(eq.base = malloc(size)))
+            return;
+        eq.size = size;
+        mem_add(MEM_THUMBNAIL, size);
+    }
+
+    memcpy(eq.base, thumbnail_ctx.thumbnail, size);
+    memcpy(eq.base_values, eq.shot_values, sizeof(eq.base_values));
+
+    /* the equalizer may have changed while the screenshot was pending */
+    eq_apply();
+}
+
+/*
+ * progressive thumbnails: a slow libswscale filter on a large screenshot would
+ * hold the image back, so the screenshot is copied and first scaled with
+ * scale_sample(), which is sent right away. the configured filter runs once
+ * the event loop is idle, and the result is only sent if the notification is
+ * still open and it actually looks different. this is only done once the
+ * filter has been measured to take REFINE_MIN_NS, since the copy is as large as
+ * the screenshot. the reply itself can't be kept instead, as mpv reclaims it on
+ * the next mpv_wait_event().
+ */
+#define REFINE_MIN_NS (8 * NS_PER_MS)
+
+static struct {
+    uint8_t *src;
+    size_t size;
+    bool pending;
+    /* how long the last full libswscale pass took */
+    int64_t sws_ns;
+} refine;
+
+static void refine_free(void)
+{
+    if (!refine.src)
+        return;
+
+    mem_add(MEM_REFINE, -(int64_t)refine.size);
+    free(refine.src);
+    refine.src = NULL;
+    refine.pending = false;
+}
+
+/* returns whether the screenshot was kept for later, and needs a preview */
+static bool refine_defer(const uint8_t *data)
+{
+    if (!opt_true(O_PROGRESSIVE) || refine.sws_ns < REFINE_MIN_NS ||
+            opt_node(O_THUMBNAIL_SCALING)->u.int64 == SWS_FAST_BILINEAR)
+        return false;
+
+    size_t size = (size_t)thumbnail_ctx.src_stride * thumbnail_ctx.src_h;
+    if (refine.src && refine.size != size)
+        refine_free();
+    if (!refine.src) {
+        if (!mem_reserve(size) || !(refine.src = malloc(size)))
+            return false;
+        refine.size = size;
+        mem_add(MEM_REFINE, size);
+    }
+
+    memcpy(refine.src, data, size);
+    refine.pending = true;
+    return true;
+}
+
+static void thumbnail_ctx_destroy(void)
+{
+    uint8_t *thumbnail = thumbnail_ctx.thumbnail;
+    SwsContext *sws = thumbnail_ctx.sws;
+    if (thumbnail)
+        mem_add(MEM_THUMBNAIL, -(int64_t)thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h);
+    if (sws)
+        mem_add(MEM_SCALER, -sws_cost_estimate());
+
+    eq_free();
+    refine_free();
+    memset(&thumbnail_ctx, 0, sizeof(thumbnail_ctx));
+    /* the image hint references the buffer, so drop it first */
+    ntf_set_image();
+
+    free(thumbnail);
+#if HAVE_SWSCALE
+    if (sws)
+        thumbnail_libs.sws_freeContext(sws);
+#else
+    (void)sws;
+#endif
+
+    VERBOSE("destroyed thumbnail context");
+}
+
+static void thumbnail_ctx_maybe_new(double src_w, double src_h,
+        double src_stride)
+{
+    if (src_w == thumbnail_ctx.src_w && src_h == thumbnail_ctx.src_h &&
+            (!opt_true(O_DISABLE_SCALING) ||
+             src_stride == thumbnail_ctx.src_stride)) {
+        /* we can keep the same ctx if only src stride changes with sws, but
+         * remember to update it before processing */
+        thumbnail_ctx.src_stride = src_stride;
+        return;
+    }
+
+    thumbnail_ctx_destroy();
+
+    thumbnail_ctx.src_w = src_w;
+    thumbnail_ctx.src_stride = src_stride;
+    thumbnail_ctx.src_h = src_h;
+    if (opt_true(O_DISABLE_SCALING)) {
+        thumbnail_ctx.dst_w = src_w;
+        thumbnail_ctx.dst_stride = src_stride;
+        thumbnail_ctx.dst_h = src_h;
+    } else {
+        double scaled_size = (double)opt_node(O_THUMBNAIL_SIZE)->u.int64;
+        double ratio = fmin(scaled_size / src_w, scaled_size / src_h);
+        thumbnail_ctx.dst_w = MAX(1, (int)(src_w * ratio));
+        thumbnail_ctx.dst_stride = thumbnail_ctx.dst_w * 4;
+        thumbnail_ctx.dst_h = MAX(1, (int)(src_h * ratio));
+        thumbnail_ctx.scale_sample = visualizer_batched();
+#if HAVE_SWSCALE
+        /* the built-in scaler needs no memory of its own, so fall back to it */
+        if (thumbnail_libs.loaded && !thumbnail_ctx.scale_sample &&
+                mem_reserve(sws_cost_estimate())) {
+            thumbnail_ctx.sws = thumbnail_libs.sws_getContext(src_w, src_h, AV_PIX_FMT_RGBA,
+                    thumbnail_ctx.dst_w, thumbnail_ctx.dst_h, AV_PIX_FMT_RGBA,
+                    opt_node(O_THUMBNAIL_SCALING)->u.int64, NULL, NULL, NULL);
+            if (!thumbnail_ctx.sws) {
+                thumbnail_ctx_destroy();
+                return;
+            }
+            mem_add(MEM_SCALER, sws_cost_estimate());
+        }
+#endif
+        thumbnail_ctx.scale_builtin = !thumbnail_ctx.sws &&
+            !thumbnail_ctx.scale_sample;
+    }
+
+    int64_t alloc_size = thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h;
+
+    if (alloc_size > MAX_IMAGE_SIZE) {
+        ERR("thumbnail output resolution is too large, disabling thumbnails");
+        thumbnail_ctx_destroy();
+        return;
+    }
+
+    if (!mem_reserve(alloc_size)) {
+        if (!mem.thumbnail_denied)
+            ERR("thumbnail doesn't fit in memory_budget, disabling thumbnails");
+        mem.thumbnail_denied = true;
+        thumbnail_ctx_destroy();
+        return;
+    }
+
+    thumbnail_ctx.thumbnail = malloc(alloc_size);
+    if (!thumbnail_ctx.thumbnail) {
+        thumbnail_ctx_destroy();
+        return;
+    }
+    mem_add(MEM_THUMBNAIL, alloc_size);
+
+    /* this function is only called while ntf_image_enabled is true */
+    ntf_set_image();
+    VERBOSE("configured thumbnail context");
+}
+
+static void thumbnail_ctx_process(void *data)
+{
+    if (!thumbnail_ctx.thumbnail)
+        return;
+
+    struct timespec tp[2] = {0};
+    if (opt_true(O_PERFDATA))
+        clock_gettime(CLOCK_MONOTONIC, &tp[0]);
+
+    watch_push(W_SCALE);
+    int64_t scale_start = mono_ns();
+    if (thumbnail_ctx.sws && refine_defer(data)) {
+        scale_sample(data, thumbnail_ctx.src_w, thumbnail_ctx.src_h,
+                thumbnail_ctx.src_stride, thumbnail_ctx.thumbnail,
+                thumbnail_ctx.dst_w, thumbnail_ctx.dst_h,
+                thumbnail_ctx.dst_stride);
+    } else if (thumbnail_ctx.sws) {
+#if HAVE_SWSCALE
+        const uint8_t *const src_slice[1] = {data};
+        const int src_stride[1] = {thumbnail_ctx.src_stride};
+        uint8_t *const dst[1] = {thumbnail_ctx.thumbnail};
+        const int dst_stride[1] = {thumbnail_ctx.dst_stride};
+        thumbnail_libs.sws_scale(thumbnail_ctx.sws, src_slice, src_stride, 0,
+                thumbnail_ctx.src_h, dst, dst_stride);
+#endif
+        refine.sws_ns = mono_ns() - scale_start;
+    } else if (thumbnail_ctx.scale_sample) {
+        scale_sample(data, thumbnail_ctx.src_w, thumbnail_ctx.src_h,
+                thumbnail_ctx.src_stride, thumbnail_ctx.thumbnail,
+                thumbnail_ctx.dst_w, thumbnail_ctx.dst_h,
+                thumbnail_ctx.dst_stride);
+    } else if (thumbnail_ctx.scale_builtin) {
+        scale_box(data, thumbnail_ctx.src_w, thumbnail_ctx.src_h,
+                thumbnail_ctx.src_stride, thumbnail_ctx.thumbnail,
+                thumbnail_ctx.dst_w, thumbnail_ctx.dst_h,
+                thumbnail_ctx.dst_stride);
+    } else {
+        memcpy(thumbnail_ctx.thumbnail, data,
+                thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h);
+    }
+    hist_record(H_SCALE_US, mono_ns() - scale_start);
+    watch_pop();
+    eq_store();
+
+    if (opt_true(O_PERFDATA)) {
+        clock_gettime(CLOCK_MONOTONIC, &tp[1]);
+        long in_ns[2];
+        in_ns[0] = tp[0].tv_sec * 1e9 + tp[0].tv_nsec;
+        in_ns[1] = tp[1].tv_sec * 1e9 + tp[1].tv_nsec;
+        pd_thumbnail = (in_ns[1] - in_ns[0]) / 1e3;
+        rewrite_body = true;
+    }
+
+    if (skip_burst.image_stale && !skip_burst.active) {
+        skip_burst.image_stale = false;
+        ntf_set_image();
+    }
+
+    if (visualizer_batched() && timer_armed)
+        visualizer_frame_unsent = true;
+    else
+        done_actions |= A_NTF_UPD;
+}
+
+/* the second stage of a progressive thumbnail, see refine_defer() */
+static void refine_run(void)
+{
+    if (!refine.pending)
+        return;
+
+    size_t size = (size_t)thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h;
+    uint8_t *preview = thumbnail_ctx.sws ? malloc(size) : NULL;
+    if (!preview) {
+        /* the preview stays, rather than idling here again */
+        refine_free();
+        return;
+    }
+    memcpy(preview, thumbnail_ctx.thumbnail, size);
+
+    int64_t scale_start = mono_ns();
+#if HAVE_SWSCALE
+    const uint8_t *const src_slice[1] = {refine.src};
+    const int src_stride[1] = {thumbnail_ctx.src_stride};
+    uint8_t *const dst[1] = {thumbnail_ctx.thumbnail};
+    const int dst_stride[1] = {thumbnail_ctx.dst_stride};
+    thumbnail_libs.sws_scale(thumbnail_ctx.sws, src_slice, src_stride, 0,
+            thumbnail_ctx.src_h, dst, dst_stride);
+#endif
+    refine.sws_ns = mono_ns() - scale_start;
+    hist_record(H_SCALE_US, refine.sws_ns);
+    /* the screenshot isn't needed anymore, and it's large */
+    refine_free();
+
+    /* the preview was the equalizer base, the refined image takes its place */
+    if (eq.base && eq.size == size) {
+        memcpy(eq.base, thumbnail_ctx.thumbnail, size);
+        eq_apply();
+    }
+
+    stats_add(S_REFINES, 1);
+    if (memcmp(preview, thumbnail_ctx.thumbnail, size)) {
+        thumb_shm_publish();
+        if (timer_armed) {
+            stats_add(S_REFINES_SENT, 1);
+            if (visualizer_batched())
+                visualizer_frame_unsent = true;
+            else
+                done_actions |= A_NTF_UPD;
+        }
+    }
+    free(preview);
+}
+
+static bool ntf_update_server_caps(void)
+{
+    server_body_markup = false;
+
+    GList *server_cap_list;
+    if (!(server_cap_list = notify_get_server_caps()))
+        return false;
+
+    for (GList *l = server_cap_list; l; l = l->next) {
+        if (!strcmp(l->data, "body-markup")) {
+            server_body_markup = true;
+            g_free(l->data);
+            break;
+        }
+
+        g_free(l->data);
+    }
+
+    VERBOSE("server supports markup? %d", server_body_markup);
+    g_list_free(server_cap_list);
+    return true;
+}
+
+/*
+ * enable or disable notification image support based on some criteria:
+ * - disable if idling
+ * - disable if there is no video track selected, unless a lavfi-complex is
+ *   enabled or we're in the middle of switching tracks
+ * - disable if send_thumbnail=no
+ *
+ * we have to turn it on/off ourselves instead of relying on an empty/error
+ * screenshot to determine this, because when going from a video to no
+ * video selected/idle player, screenshots actually still work and return the
+ * image from the last displayed frame from the last played video.
+ *
+ * we don't immediately queue a screenshot after enabling images because that
+ * could yield a screenshot of the last frame of a previous video. if switching
+ * video tracks or exiting idle mode, video reconfig should happen soon which
+ * will queue a correct screnshot when the new video is ready. if instead
+ * send_thumbnail was changed, that handler will have queued a screenshot.
+ */
+static void ntf_check_image(void)
+{
+    bool switching_track = !op_true(P_IDLE_ACTIVE) && !op_avail(P_VID) &&
+        !metadata_avail;
+
+    if (op_true(P_IDLE_ACTIVE) || !opt_true(O_SEND_THUMBNAIL) ||
+            (!op_avail(P_VID) && !op_true(P_LAVFI_COMPLEX) && !switching_track)) {
+        if (ntf_image_enabled) {
+            VERBOSE("notification image disabled");
+            ntf_image_enabled = false;
+            thumbnail_ctx_destroy();
+            thumb_shm_publish();
+            done_actions |= A_NTF_UPD;
+        }
+        return;
+    }
+
+    if (!ntf_image_enabled) {
+        thumbnail_libs_load();
+        VERBOSE("notification image enabled");
+        ntf_image_enabled = true;
+    }
+}
+
+/* returns false if there is no progress to show */
+static bool get_progress(long *progress)
+{
+    if (op_true(P_IDLE_ACTIVE))
+        return false;
+
+    if (op_true(P_USER_DATA__DETECT_IMAGE__DETECTED)) {
+        if (op_avail(P_PLAYLIST_POS) && observed_props[P_PLAYLIST_COUNT].node.u.int64 > 1) {
+            double gallery_percent =
+                (observed_props[P_PLAYLIST_POS].node.u.int64 + 1) / (double)observed_props[P_PLAYLIST_COUNT].node.u.int64;
+            *progress = lround(gallery_percent * 100);
+            return true;
+        }
+        return false;
+    }
+
+    *progress = percent_pos_rounded;
+    return true;
+}
+
+static void ntf_set_progress_bar(void)
+{
+    if (!ntf)
+        return;
+
+    long progress;
+    if (!opt_true(O_SEND_PROGRESS) || !get_progress(&progress)) {
+        notify_notification_set_hint(ntf, "value", NULL);
+        return;
+    }
+
+    GVariant *v = g_variant_new("i", progress);
+    notify_notification_set_hint(ntf, "value", v);
+}
+
+static void ntf_set_urgency(void)
+{
+    if (!ntf)
+        return;
+
+    notify_notification_set_urgency(ntf, opts[O_NTF_URGENCY].u.int64);
+}
+
+static void ntf_set_category(void)
+{
+    if (!ntf)
+        return;
+
+    if (opt_true(O_NTF_CATEGORY)) {
+        notify_notification_set_category(ntf, opts[O_NTF_CATEGORY].u.string);
+    } else {
+        /* notify_notification_set_category doesn't unset if you pass NULL */
+        notify_notification_set_hint(ntf, "category", NULL);
+    }
+}
+
+static void ntf_set_app_name(void)
+{
+    if (!notify_is_initted())
+        return;
+
+    if (op_true(P_APP_NAME))
+        notify_set_app_name(observed_props[P_APP_NAME].node.u.string);
+    else
+        notify_set_app_name("mpv");
+}
+
+static void ntf_set_app_icon(void)
+{
+    if (!notify_is_initted())
+        return;
+
+    if (opt_true(O_NTF_APP_ICON))
+        notify_set_app_icon(opts[O_NTF_APP_ICON].u.string);
+    else
+        notify_set_app_icon(NULL);
+}
+
+static void ntf_close(void)
+{
+    if (!ntf)
+        return;
+
+    DEBUG("notification close");
+    GError *gerr = NULL;
+    if (!notify_notification_close(ntf, &gerr)) {
+        ERR("failed to close notification: %s", gerr->message);
+        g_error_free(gerr);
+    }
+}
+
+static void ntf_set_image(void)
+{
+    if (!ntf)
+        return;
+
+    if (!thumbnail_ctx.thumbnail || skip_burst.image_stale) {
+        notify_notification_set_hint(ntf, "image-data", NULL);
+        return;
+    }
+
+    /*
+     * build the image-data hint straight from the thumbnail buffer. like the
+     * variant libnotify makes for a pixbuf, it references the buffer instead of
+     * copying it, so each show sends whatever was last scaled into it.
+     */
+    GVariant *pixels = g_variant_new_from_data(G_VARIANT_TYPE("ay"),
+            thumbnail_ctx.thumbnail,
+            (size_t)thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h, true,
+            NULL, NULL);
+    GVariant *image_data = g_variant_new("(iiibii@ay)", thumbnail_ctx.dst_w,
+            thumbnail_ctx.dst_h, thumbnail_ctx.dst_stride, true, 8, 4, pixels);
+    notify_notification_set_hint(ntf, "image-data", image_data);
+}
+
+static void ntf_uninit(void)
+{
+    ntf_close();
+    if (ntf) {
+        g_object_unref(ntf);
+        ntf = NULL;
+    }
+    if (notify_is_initted())
+        notify_uninit();
+}
+
+static void ntf_init(void)
+{
+    int64_t start = mono_ns();
+    stats_add(S_NTF_INITS, 1);
+
+    if (!notify_init("mpv")) {
+        ERR("notify_init() failed");
+        return;
+    }
+
+    if (!ntf_update_server_caps()) {
+        ERR("failed to get server caps");
+        ntf_uninit();
+        return;
+    }
+
+    ntf_set_app_name();
+    ntf_set_app_icon();
+
+    if (!(ntf = notify_notification_new(summary, body, NULL))) {
+        ERR("failed to create notification");
+        ntf_uninit();
+        return;
+    }
+    notify_notification_set_timeout(ntf, NOTIFY_EXPIRES_NEVER);
+
+    ntf_set_progress_bar();
+    ntf_set_category();
+    ntf_set_urgency();
+    ntf_set_image();
+
+    stats_set(S_NTF_INIT_US, (mono_ns() - start) / 1000);
+}
+
+/*
+ * strings which were escaped (or not) according to a previous value of
+ * server_body_markup need to be fetched again
+ */
+static void reescape_props(void)
+{
+    VERBOSE("server markup support changed, escaping properties again");
+
+    for (size_t i = 0; i < sizeof(observed_props) / sizeof(observed_props[0]); i++) {
+        struct observed_prop *prop = &observed_props[i];
+        if (!prop->string_needs_escaping || prop->node.format != MPV_FORMAT_STRING)
+            continue;
+
+        char *raw = mpv_get_property_string(hmpv, prop->name);
+        if (!raw)
+            continue;
+        free(prop->node.u.string);
+        prop->node.u.string = strdupesc(raw);
+        mpv_free(raw);
+    }
+
+    if (metadata_avail) {
+        mpv_node metadata_node = {0};
+        if (mpv_get_property(hmpv, "metadata", MPV_FORMAT_NODE,
+                    &metadata_node) == 0) {
+            mpv_event_property event_prop = {
+                .name = "metadata",
+                .format = MPV_FORMAT_NODE,
+                .data = &metadata_node,
+            };
+            metadata_update(&event_prop);
+            mpv_free_node_contents(&metadata_node);
+        }
+    }
+
+    if (osd_str_chapter)
+        get_osd_str_chapter();
+    if (osd_str_edition)
+        get_osd_str_edition();
+
+    rewrite_summary = true;
+    rewrite_body = true;
+}
+
+static bool ntf_init_attempted;
+
+static void ntf_lazy_init(void);
+
+static void on_ntf_init_timer(__attribute__((unused)) struct sched_timer *t)
+{
+    ntf_lazy_init();
+}
+
+static struct sched_timer ntf_init_timer = {
+    .name = "ntf-init",
+    .cb = on_ntf_init_timer,
+};
+
+/*
+ * connecting to the bus and getting the server caps is a D-Bus round trip, so
+ * it's kept off of mpv's startup path. it happens from ntf_init_timer shortly
+ * after the event loop starts, or when the first notification is needed if
+ * that comes sooner. until then, strings are stored as if the server doesn't
+ * support markup.
+ */
+static void ntf_lazy_init(void)
+{
+    if (ntf_init_attempted)
+        return;
+
+    ntf_init_attempted = true;
+    sched_cancel(&ntf_init_timer);
+
+    bool old_body_markup = server_body_markup;
+    watch_push(W_NTF_INIT);
+    ntf_init();
+    watch_pop();
+    if (ntf && server_body_markup != old_body_markup)
+        reescape_props();
+}
+
+static void write_summary(void)
+{
+    DEBUG("writing summary");
+    if (metadata[M_ARTIST] && metadata[M_TITLE]) {
+        snprintf(summary_store, sizeof(summary_store), "%s - %s",
+                metadata[M_ARTIST], metadata[M_TITLE]);
+        summary = summary_store;
+    } else if (op_true(P_MEDIA_TITLE)) {
+        summary = observed_props[P_MEDIA_TITLE].node.u.string;
+    } else {
+        summary = "No file";
+    }
+}
+
+static void seconds_to_hhmmss(int64_t total_sec, char *buf, size_t size)
+{
+    int hours = total_sec / 3600;
+    int minutes = (total_sec % 3600) / 60;
+    int seconds = total_sec % 60;
+    snprintf(buf, size, "%02d:%02d:%02d", hours, minutes, seconds);
+}
+
+#define APPEND(...) { \
+    body_count += snprintf(body + body_count, sizeof(body) - body_count, __VA_ARGS__); \
+    if (body_count >= sizeof(body)) { return; } \
+}
+
+static void write_body(void)
+{
+    DEBUG("writing body");
+
+    size_t body_count = 0;
+
+    /* L1: playback indicators and progress */
+
+    if (op_avail(P_PLAYLIST_POS) &&
+            observed_props[P_PLAYLIST_COUNT].node.u.int64 > 1) {
+        if (op_avail(P_LOOP_PLAYLIST) &&
+                strcmp(observed_props[P_LOOP_PLAYLIST].node.u.string, "no")) {
+            APPEND("🔁 ");
+        }
+        APPEND("(%02" PRId64 "/%02" PRId64 ") ",
+                observed_props[P_PLAYLIST_POS].node.u.int64 + 1,
+                observed_props[P_PLAYLIST_COUNT].node.u.int64);
+    }
+
+    if (op_true(P_PAUSED_FOR_CACHE) || op_true(P_SEEKING)) {
+        APPEND("⏲");
+    } else if (op_true(P_PAUSE)) {
+        APPEND("⏸");
+    } else if (op_true(P_PLAY_DIRECTION) &&
+            !strcmp(observed_props[P_PLAY_DIRECTION].node.u.string, "backward")) {
+        APPEND("◀");
+    } else {
+        APPEND("▶");
+    }
+
+    if (!op_true(P_IDLE_ACTIVE) && !op_true(P_USER_DATA__DETECT_IMAGE__DETECTED) &&
+            op_avail(P_TIME_POS)) {
+        char com_time_time[16];
+        seconds_to_hhmmss(observed_props[P_TIME_POS].node.u.int64,
+                com_time_time, sizeof(com_time_time));
+
+        if (op_avail(P_DURATION)) {
+            char com_time_duration[16];
+            seconds_to_hhmmss(observed_props[P_DURATION].node.u.int64,
+                    com_time_duration, sizeof(com_time_duration));
+
+            APPEND(" %s / %s (%d%%)", com_time_time, com_time_duration,
+                    (int)percent_pos_rounded);
+        } else {
+            APPEND(" %s (%d%%)", com_time_time, (int)percent_pos_rounded);
+        }
+
+        if (op_avail(P_LOOP_FILE) &&
+                strcmp(observed_props[P_LOOP_FILE].node.u.string, "no")) {
+            APPEND(" 🔁");
+        }
+    }
+
+    if (op_avail(P_SPEED) && observed_props[P_SPEED].node.u.double_ != 1) {
+        APPEND(" (%.2fx)", observed_props[P_SPEED].node.u.double_);
+    }
+
+    if (op_true(P_MUTE)) {
+        APPEND(" 🔇");
+    }
+
+    if (op_avail(P_VOLUME) && observed_props[P_VOLUME].node.u.int64 != 100) {
+        APPEND(" (🔊 %" PRId64 "%%)", observed_props[P_VOLUME].node.u.int64);
+    }
+
+    if (!op_avail(P_IMAGE_DISPLAY_DURATION) ||
+            !isnormal(observed_props[P_IMAGE_DISPLAY_DURATION].node.u.double_)) {
+        if (!op_true(P_USER_DATA__DETECT_IMAGE__DETECTED) && op_true(P_KEEP_OPEN) &&
+                strcmp(observed_props[P_KEEP_OPEN].node.u.string, "always")) {
+            APPEND(" (auto)");
+        }
+    } else if (op_true(P_USER_DATA__DETECT_IMAGE__DETECTED)) {
+        APPEND(" (ss: %.0fs)", observed_props[P_IMAGE_DISPLAY_DURATION].node.u.double_);
+    }
+
+    /* TODO: don't use OSD formatting, compose it ourself */
+
+    /* L2: chapter title and position, if there is more than one chapter */
+
+    if (osd_str_chapter && osd_str_chapters)
+        APPEND("\nChapter: %s / %s", osd_str_chapter, osd_str_chapters);
+
+    /* L3: edition title and position, if there is more than one edition */
+
+    if (osd_str_edition && osd_str_editions)
+        APPEND("\nEdition: %s / %s", osd_str_edition, osd_str_editions);
+
+    /* L4: release information, if available */
+
+    const char *album_artist_txt = metadata[M_ALBUM_ARTIST];
+    if (!album_artist_txt) album_artist_txt = metadata[M_ARTIST__ESC];
+
+    if (metadata[M_ALBUM]) {
+        const char *date_txt = metadata[M_ORIGINALYEAR];
+        if (!date_txt) date_txt = metadata[M_ORIGINALDATE__YEAREXT];
+        if (!date_txt) date_txt = metadata[M_YEAR];
+        if (!date_txt) date_txt = metadata[M_DATE__YEAREXT];
+
+        APPEND("\n");
+        if (album_artist_txt)
+            APPEND("%s - ", album_artist_txt);
+        APPEND("%s", metadata[M_ALBUM]);
+        if (date_txt)
+            APPEND(" (%s)", date_txt);
+    } else {
+        const char *date_txt = metadata[M_ORIGINALYEAR];
+        if (!date_txt) date_txt = metadata[M_ORIGINALDATE];
+        if (!date_txt) date_txt = metadata[M_YEAR];
+        if (!date_txt) date_txt = metadata[M_DATE];
+        if (date_txt) APPEND("\nDate: %s", date_txt);
+    }
+
+    /* L5: disc position, for multi-disc releases */
+
+    const char *totaldiscs_txt = metadata[M_TOTALDISCS];
+    if (!totaldiscs_txt) totaldiscs_txt = metadata[M_DISCTOTAL];
+    if (!totaldiscs_txt) totaldiscs_txt = metadata[M_DISCC];
+    const char *disc_txt = metadata[M_DISC];
+    if (!disc_txt) disc_txt = metadata[M_DISCNUMBER];
+
+    if (disc_txt && totaldiscs_txt &&
+            strcmp(totaldiscs_txt, "0") &&
+            strcmp(totaldiscs_txt, "1"))
+        APPEND("\nDisc: %s / %s", disc_txt, totaldiscs_txt);
+
+    /* L6: an additional message */
+
+    const char *body_exttxt = NULL;
+
+    if (op_true(P_EOF_REACHED) && op_avail(P_PLAYLIST_POS) &&
+            observed_props[P_PLAYLIST_COUNT].node.u.int64 > 0 &&
+            observed_props[P_PLAYLIST_POS].node.u.int64 >= 0) {
+        if (observed_props[P_PLAYLIST_COUNT].node.u.int64 > 1 &&
+                observed_props[P_PLAYLIST_POS].node.u.int64 + 1 == observed_props[P_PLAYLIST_COUNT].node.u.int64)
+            body_exttxt = "end of playlist";
+        else
+            body_exttxt = "EOF";
+    }
+
+    if (body_exttxt) {
+        if (server_body_markup) {
+            APPEND("\n<b>%s</b>", body_exttxt);
+        } else {
+            APPEND("\n%s", body_exttxt);
+        }
+    }
+
+    /* L7: perfdata */
+
+    if (opt_true(O_PERFDATA)) {
+        APPEND("\nThumbnail postprocess timing (last µs): %ld", pd_thumbnail);
+        APPEND("\nPrevious ntf show rtt (µs): %ld", pd_show);
+    }
+
+    /* L8: current subtitle/lyric text, if any */
+
+    if (opt_true(O_SEND_SUB_TEXT) && op_true(P_SUB_TEXT) && op_true(P_SUB_VISIBILITY))
+        APPEND("\n%s", observed_props[P_SUB_TEXT].node.u.string);
+
+    /* L9: stress run progress, so that every update differs */
+
+    if (stress.running)
+        APPEND("\nStress update %" PRIu64, stress.updates);
+}
+
+/*
+ * if the notification server is restarted while mpv is running, show/close will
+ * start failing with 'ServiceUnknown: The name is not activatable'. the only
+ * way to reset libnotify's global dbus proxy is to uninit and reinit the whole
+ * library.
+*/
+static void ntf_reinit(void)
+{
+    watch_push(W_NTF_INIT);
+    ntf_uninit();
+    ntf_init();
+    if (ntf) {
+        /*
+         * unobserve and reobserve all properties if server_body_markup changed
+         * so that affected properties get escaping added/removed, but also
+         * generally to retry showing the notification (this will also reset the
+         * timer, but that's ok)
+         */
+        for (size_t i = 0; i < sizeof(observed_props) / sizeof(observed_props[0]); i++) {
+            if (!mpv_has_app_name && i == P_APP_NAME)
+                continue;
+
+            if (mpv_unobserve_property(hmpv, i) < 0)
+                ERR("failed to unobserve property: %s", observed_props[i].name);
+
+            if (mpv_observe_property(hmpv, i, observed_props[i].name, observed_props[i].format) != 0)
+                ERR("failed to observe property: %s", observed_props[i].name);
+        }
+    }
+    watch_pop();
+}
+
+/* returns whether the notification object exists */
+static bool ntf_ensure(void)
+{
+    if (ntf)
+        return true;
+
+    if (ntf_init_attempted) {
+        ntf_reinit();
+        return false;
+    }
+
+    ntf_lazy_init();
+    return ntf;
+}
+
+static void ntf_show(void)
+{
+    GError *gerr = NULL;
+    visualizer_frame_unsent = false;
+
+    struct timespec tp[2] = {0};
+    if (opt_true(O_PERFDATA))
+        clock_gettime(CLOCK_MONOTONIC, &tp[0]);
+
+    watch_push(W_NTF_SHOW);
+    int64_t show_start = mono_ns();
+    bool shown = notify_notification_show(ntf, &gerr);
+    int64_t show_ns = mono_ns() - show_start;
+    hist_record(H_NTF_SHOW_US, show_ns);
+    if (stress.running) {
+        stress.sends++;
+        if (stress.num_rtt < stress.max_rtt)
+            stress.rtt_ns[stress.num_rtt++] = show_ns;
+    }
+    watch_pop();
+    if (!shown) {
+        ERR("failed to show notification: %s", gerr->message);
+        g_error_free(gerr);
+        ntf_reinit();
+    }
+
+    if (opt_true(O_PERFDATA)) {
+        clock_gettime(CLOCK_MONOTONIC, &tp[1]);
+        long in_ns[2];
+        in_ns[0] = tp[0].tv_sec * 1e9 + tp[0].tv_nsec;
+        in_ns[1] = tp[1].tv_sec * 1e9 + tp[1].tv_nsec;
+        pd_show = (in_ns[1] - in_ns[0]) / 1e3;
+        rewrite_body = true;
+    }
+}
+
+/* shared by the notification and the status sink, so it's done once */
+static void compose_text(void)
+{
+    watch_push(W_COMPOSE);
+    if (rewrite_summary)
+        write_summary();
+    if (rewrite_body)
+        write_body();
+    watch_pop();
+
+    text_unsent |= rewrite_summary || rewrite_body;
+    rewrite_summary = false;
+    rewrite_body = false;
+}
+
+static void ntf_upd(void)
+{
+    if (!ntf_ensure())
+        return;
+
+    compose_text();
+
+    DEBUG("sending notification");
+    if (text_unsent)
+        notify_notification_update(ntf, summary, body, NULL);
+    text_unsent = false;
+
+    ntf_show();
+}
+
+static int64_t last_screenshot_ns;
+
+static void on_capture_timer(__attribute__((unused)) struct sched_timer *t)
+{
+    done_actions |= A_QUEUE_SHOT;
+}
+
+/* a capture which was held back by capture_interval */
+static struct sched_timer capture_timer = {
+    .name = "capture",
+    .cb = on_capture_timer,
+};
+
+/*
+ * screenshots shouldn't usually happen while the expire timer isn't armed, but
+ * we allow it to be forced when a video reconfig happens so that we have a
+ * screenshot of the current file's cover art (or first frame of a video) ready
+ * so that opening a notification doesn't briefly flicker with an image from a
+ * different album or mpv icon.
+ */
+static void queue_screenshot(bool force)
+{
+    if (!ntf_image_enabled || (!timer_armed && (!force && !force_open)))
+        return;
+
+    if (mem.thumbnail_denied)
+        return;
+
+    if (skip_burst.active) {
+        /* it would likely be of a track that's about to be skipped past */
+        stats_add(S_SKIP_BURST_DEFERRED, 1);
+        return;
+    }
+
+    int64_t interval = opt_node(O_CAPTURE_INTERVAL)->u.int64 * NS_PER_MS;
+    int64_t now = mono_ns();
+    if (!force && interval && now - last_screenshot_ns < interval) {
+        if (!sched_pending(&capture_timer))
+            sched_add(&capture_timer, last_screenshot_ns + interval - now, 0,
+                    interval / 4);
+        return;
+    }
+    sched_cancel(&capture_timer);
+    last_screenshot_ns = now;
+
+    if (screenshot_in_progress) {
+        if (stress.running)
+            stress.superseded++;
+#if 0
+        VERBOSE("aborting current screenshot command");
+        mpv_abort_async_command(hmpv, UD_SCREENSHOT);
+#endif
+        screenshot_in_progress = false;
+    }
+
+    const char *screenshot_args[] = {
+        "screenshot-raw", opt_node(O_SCREENSHOT_FLAGS)->u.string, "rgba", NULL
+    };
+
+    int mpv_err;
+    if (!(mpv_err = mpv_command_async(hmpv, UD_SCREENSHOT, screenshot_args))) {
+        screenshot_in_progress = true;
+        screenshot_time = observed_props[P_TIME_POS].node.u.int64;
+        screenshot_time_exact = thumb_service_time();
+        eq.shot_valid = eq_values(eq.shot_values);
+        DEBUG("queued screenshot");
+    } else {
+        ERR("failed to queue screenshot: %d", mpv_err);
+    }
+}
+
+/*
+ * arbitration between instances: a lease in a small shared file under
+ * $XDG_RUNTIME_DIR records which instance most recently got an A_NTF_RST. only
+ * that instance shows notifications and takes screenshots, the others stay
+ * dormant (closing their notification if it was open) until they get one
+ * themselves.
+ */
+struct lease {
+    /* lease_token of the owner, 0 if nobody took it yet */
+    _Atomic uint64_t owner;
+    /* incremented on every change of ownership */
+    _Atomic uint64_t generation;
+};
+
+static struct lease *lease;
+static uint64_t lease_token;
+static bool lease_dormant;
+
+/* writes $XDG_RUNTIME_DIR/<client><suffix> into buf */
+static bool runtime_path(char *buf, size_t size, const char *suffix)
+{
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (!str_is_set(runtime_dir)) {
+        ERR("XDG_RUNTIME_DIR is not set");
+        return false;
+    }
+
+    return snprintf(buf, size, "%s/%s%s", runtime_dir, client_name,
+            suffix) < (int)size;
+}
+
+static void lease_close(void)
+{
+    if (lease)
+        munmap(lease, sizeof(*lease));
+    lease = NULL;
+    lease_dormant = false;
+}
+
+static void lease_open(void)
+{
+    char path[PATH_MAX];
+    if (!runtime_path(path, sizeof(path), ".lease"))
+        return;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        ERR("failed to open %s: %m", path);
+        return;
+    }
+
+    /* a new file is zero-filled, which is a valid unowned lease */
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+            ((size_t)st.st_size < sizeof(*lease) &&
+             ftruncate(fd, sizeof(*lease)) == -1)) {
+        ERR("failed to size %s: %m", path);
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, sizeof(*lease), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ERR("failed to map %s: %m", path);
+        return;
+    }
+
+    lease = map;
+    /* the pid alone could be reused while a stale token is still stored */
+    lease_token = ((uint64_t)getpid() << 32) | (uint32_t)mono_ns();
+    VERBOSE("opened lease %s", path);
+}
+
+/*
+ * metrics file: with metrics_file=yes, the stats and histograms live in a
+ * shared file instead of private memory, so notification-osd-metrics (or any
+ * other reader of the layout in notification-osd-metrics.h) can dump them
+ * without going through mpv. updating them costs the same either way.
+ */
+static struct {
+    void *map;
+    size_t size;
+    char path[PATH_MAX];
+} metrics = {0};
+
+static void metrics_close(void)
+{
+    if (!metrics.map)
+        return;
+
+    /* carry on counting in private memory */
+    for (int i = 0; i < S_END; i++)
+        atomic_store_explicit(&stats_local[i], stats_get(i), memory_order_relaxed);
+    for (int h = 0; h < H_END; h++) {
+        for (int b = 0; b < NOSD_METRICS_HIST_BUCKETS; b++)
+            atomic_store_explicit(&hists_local[h][b], atomic_load_explicit(
+                        &hists[h][b], memory_order_relaxed), memory_order_relaxed);
+    }
+    stats = stats_local;
+    hists = hists_local;
+
+    munmap(metrics.map, metrics.size);
+    unlink(metrics.path);
+    metrics.map = NULL;
+}
+
+static void metrics_open(void)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%d.metrics", (int)getpid());
+    if (!runtime_path(metrics.path, sizeof(metrics.path), suffix))
+        return;
+
+    struct nosd_metrics_header header = {
+        .version = NOSD_METRICS_VERSION,
+        .pid = getpid(),
+        .num_counters = S_END,
+        .num_histograms = H_END,
+        .hist_buckets = NOSD_METRICS_HIST_BUCKETS,
+        .names_offset = sizeof(header),
+    };
+    header.counters_offset = header.names_offset +
+        (S_END + H_END) * NOSD_METRICS_NAME_LEN;
+    /* the names are a multiple of 8 bytes, so the counters are aligned */
+    header.histograms_offset = header.counters_offset + S_END * sizeof(int64_t);
+    header.size = header.histograms_offset +
+        H_END * NOSD_METRICS_HIST_BUCKETS * sizeof(uint64_t);
+
+    int fd = open(metrics.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        ERR("failed to open %s: %m", metrics.path);
+        return;
+    }
+
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, header.size) == 0)
+        map = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ERR("failed to map %s: %m", metrics.path);
+        unlink(metrics.path);
+        return;
+    }
+
+    char *names = (char *)map + header.names_offset;
+    for (int i = 0; i < S_END; i++)
+        strncpy(names + i * NOSD_METRICS_NAME_LEN, stats_names[i],
+                NOSD_METRICS_NAME_LEN - 1);
+    for (int h = 0; h < H_END; h++)
+        strncpy(names + (S_END + h) * NOSD_METRICS_NAME_LEN, hist_names[h],
+                NOSD_METRICS_NAME_LEN - 1);
+
+    _Atomic int64_t *counters = (void *)((char *)map + header.counters_offset);
+    _Atomic uint64_t (*histograms)[NOSD_METRICS_HIST_BUCKETS] =
+        (void *)((char *)map + header.histograms_offset);
+    for (int i = 0; i < S_END; i++)
+        atomic_store_explicit(&counters[i], stats_get(i), memory_order_relaxed);
+    for (int h = 0; h < H_END; h++) {
+        for (int b = 0; b < NOSD_METRICS_HIST_BUCKETS; b++)
+            atomic_store_explicit(&histograms[h][b], atomic_load_explicit(
+                        &hists[h][b], memory_order_relaxed), memory_order_relaxed);
+    }
+    stats = counters;
+    hists = histograms;
+
+    memcpy(map, &header, sizeof(header));
+    atomic_thread_fence(memory_order_release);
+    memcpy(map, NOSD_METRICS_MAGIC, sizeof(header.magic));
+
+    metrics.map = map;
+    metrics.size = header.size;
+    VERBOSE("writing metrics to %s", metrics.path);
+}
+
+static void metrics_update(void)
+{
+    if (opt_true(O_METRICS_FILE) && !metrics.map)
+        metrics_open();
+    else if (!opt_true(O_METRICS_FILE) && metrics.map)
+        metrics_close();
+}
+
+static void lease_update(void)
+{
+    if (opt_true(O_ARBITRATE) && !lease)
+        lease_open();
+    else if (!opt_true(O_ARBITRATE) && lease)
+        lease_close();
+}
+
+static void lease_acquire(void)
+{
+    if (!lease)
+        return;
+
+    if (atomic_exchange_explicit(&lease->owner, lease_token,
+                memory_order_acq_rel) != lease_token) {
+        atomic_fetch_add_explicit(&lease->generation, 1, memory_order_relaxed);
+        DEBUG("acquired lease");
+    }
+    lease_dormant = false;
+}
+
+static bool lease_owned(void)
+{
+    return !lease || atomic_load_explicit(&lease->owner,
+            memory_order_acquire) == lease_token;
+}
+
+static void on_lease_timer(struct sched_timer *t)
+{
+    if (!timer_armed && !force_open) {
+        sched_cancel(t);
+        return;
+    }
+
+    /* done() does the rest */
+    if (!lease_owned())
+        DEBUG("lease taken by another instance");
+}
+
+/* notices another instance taking over while our notification is open */
+static struct sched_timer lease_timer = {
+    .name = "lease",
+    .cb = on_lease_timer,
+};
+
+static void timer_arm(void)
+{
+    timer_disarm();
+    /* like an all-zero itimerspec, a timeout of 0 never expires */
+    if (opts[O_EXPIRE_TIMEOUT].u.int64)
+        sched_add(&expire_timer, opts[O_EXPIRE_TIMEOUT].u.int64 * NS_PER_SEC,
+                0, 50 * NS_PER_MS);
+    timer_armed = true;
+
+    if (lease && !sched_pending(&lease_timer))
+        sched_add(&lease_timer, 250 * NS_PER_MS, 250 * NS_PER_MS,
+                250 * NS_PER_MS);
+}
+
+/*
+ * whether the thumbnail still shows what would be captured now: cover art
+ * doesn't change, and otherwise the frame is from the same second
+ */
+static bool thumbnail_fresh(void)
+{
+    if (!thumbnail_ctx.thumbnail || thumbnail_time < 0)
+        return false;
+
+    return op_true(P_CURRENT_TRACKS__VIDEO__IMAGE) ||
+        (op_avail(P_TIME_POS) &&
+         observed_props[P_TIME_POS].node.u.int64 == thumbnail_time);
+}
+
+/*
+ * skip bursts: skipping through a playlist (e.g. over MPRIS) changes the
+ * metadata, reconfigures the video and resets the notification for every
+ * track. once playlist-pos changes again within skip_burst_window of the last
+ * change, captures are held back and the thumbnail isn't sent, so the
+ * notification only gets text updates. when the position has stayed put for
+ * skip_burst_window, a single capture is taken for the track that was landed on.
+ */
+static void on_skip_burst_timer(__attribute__((unused)) struct sched_timer *t)
+{
+    VERBOSE("playlist position settled");
+    skip_burst.active = false;
+    if (ntf_image_enabled) {
+        /* the image is sent again once this lands */
+        done_actions |= A_FORCED_QUEUE_SHOT;
+    } else {
+        skip_burst.image_stale = false;
+        ntf_set_image();
+    }
+}
+
+static struct sched_timer skip_burst_timer = {
+    .name = "skip-burst",
+    .cb = on_skip_burst_timer,
+};
+
+static void skip_burst_update(void)
+{
+    int64_t window = opts[O_SKIP_BURST_WINDOW].u.int64 * NS_PER_MS;
+    int64_t now = mono_ns();
+    bool fast = window && now - skip_burst.last_change_ns < window;
+    skip_burst.last_change_ns = now;
+
+    if (!skip_burst.active) {
+        if (!fast)
+            return;
+
+        VERBOSE("skipping through the playlist, deferring captures");
+        stats_add(S_SKIP_BURSTS, 1);
+        skip_burst.active = true;
+        skip_burst.image_stale = true;
+        ntf_set_image();
+    }
+
+    sched_add(&skip_burst_timer, window, 0, window / 8);
 }
 
-static bool mouse_is_hovered(mpv_event_property *event_prop)
+/*
+ * batched visualizer capture: a lavfi-complex visualizer changes with every
+ * frame, so rather than each capture being sent on its own, a frame is captured
+ * every visualizer_interval while the notification is open, scaled with
+ * scale_sample(), and carried by the next text update (the time-pos ticks).
+ * a visualizer then costs at most one capture and one send per interval.
+ */
+static void on_visualizer_timer(struct sched_timer *t)
 {
-    if (event_prop->format != MPV_FORMAT_NODE)
-        return false;
+    if (!visualizer_batched() || !timer_armed) {
+        sched_cancel(t);
+        return;
+    }
 
-    struct mpv_node *node = event_prop->data;
+    if (op_true(P_PAUSE)) {
+        /* the visualizer stands still and there are no text updates */
+        if (visualizer_frame_unsent)
+            done_actions |= A_NTF_UPD;
+        return;
+    }
 
-    if (node->format != MPV_FORMAT_NODE_MAP)
-        return false;
+    stats_add(S_VISUALIZER_FRAMES, 1);
+    if (visualizer_frame_unsent)
+        stats_add(S_VISUALIZER_FRAMES_UNSENT, 1);
+    queue_screenshot(false);
+}
 
-    mpv_node_list *list = node->u.list;
-    for (int i = 0; i < list->num; i++) {
-        char *key = list->keys[i];
-        mpv_node *value = &list->values[i];
+static struct sched_timer visualizer_timer = {
+    .name = "visualizer",
+    .cb = on_visualizer_timer,
+};
 
-        if (value->format != MPV_FORMAT_FLAG)
-            continue;
+static void visualizer_update(void)
+{
+    int64_t interval = opts[O_VISUALIZER_INTERVAL].u.int64 * NS_PER_MS;
+    if (!visualizer_batched() || !timer_armed) {
+        sched_cancel(&visualizer_timer);
+        visualizer_frame_unsent = false;
+    } else if (!sched_pending(&visualizer_timer) ||
+            visualizer_timer.period != interval) {
+        sched_add(&visualizer_timer, interval, interval, interval / 8);
+    }
+}
 
-        if (!strcmp(key, "hover"))
-            return value->u.flag;
+/*
+ * speculative capture: the notification usually opens soon after the player
+ * loses focus, so a capture is taken then. when it lands first, ntf_rst()
+ * finds the thumbnail fresh and the notification is shown with it in a single
+ * send, instead of with a stale image followed by an update. only while
+ * paused: during playback the frame is stale again by the time it's shown, and
+ * ntf_rst() captures anyway
+ */
+static void on_precapture_timer(__attribute__((unused)) struct sched_timer *t)
+{
+    if (player_considered_focused() || !op_true(P_PAUSE) ||
+            screenshot_in_progress || thumbnail_fresh() || !lease_owned())
+        return;
+
+    DEBUG("speculative capture");
+    stats_add(S_PRECAPTURES, 1);
+    queue_screenshot(true);
+}
+
+/* low priority, it's delayed a bit and may run late */
+static struct sched_timer precapture_timer = {
+    .name = "precapture",
+    .cb = on_precapture_timer,
+};
+
+/*
+ * focus hysteresis: gaining focus or hover closes the notification and losing
+ * it lets it open again, so a change of the raw state only takes effect once it
+ * has held for focus_gain_delay or focus_loss_delay. moving the mouse across
+ * the window edge or quickly cycling through windows then doesn't close, reopen
+ * and recapture anything.
+ */
+static void focus_settle(void)
+{
+    player_focused = player_focused_now();
+    DEBUG("player %s focus", player_focused ? "gained" : "lost");
+
+    if (player_focused) {
+        sched_cancel(&precapture_timer);
+        done_actions |= A_NTF_CLOSE;
+    } else if (opt_true(O_PRECAPTURE) && ntf_image_enabled) {
+        sched_add(&precapture_timer, 100 * NS_PER_MS, 0, 100 * NS_PER_MS);
     }
+}
 
-    return false;
+static void on_focus_timer(__attribute__((unused)) struct sched_timer *t)
+{
+    focus_settle();
 }
 
-static void metadata_destroy(void)
+static struct sched_timer focus_timer = {
+    .name = "focus",
+    .cb = on_focus_timer,
+};
+
+static void focus_update(bool immediate)
 {
-    for (size_t i = 0; i < sizeof(metadata) / sizeof(metadata[0]); i++) {
-        if (metadata[i]) {
-            free(metadata[i]);
-            metadata[i] = NULL;
+    bool focused = player_focused_now();
+    if (focused == player_focused) {
+        if (sched_pending(&focus_timer)) {
+            sched_cancel(&focus_timer);
+            stats_add(S_FOCUS_FLAPS, 1);
         }
+        return;
+    }
+
+    int64_t delay = opts[focused ? O_FOCUS_GAIN_DELAY : O_FOCUS_LOSS_DELAY].u.int64;
+    if (immediate || !delay) {
+        sched_cancel(&focus_timer);
+        focus_settle();
+    } else if (!sched_pending(&focus_timer)) {
+        sched_add(&focus_timer, delay * NS_PER_MS, 0, 10 * NS_PER_MS);
     }
 }
 
-static void metadata_update(mpv_event_property *event_prop)
+static void on_stress_timer(struct sched_timer *t);
+
+static struct sched_timer stress_timer = {
+    .name = "stress",
+    .cb = on_stress_timer,
+};
+
+/*
+ * synthetic load: script-message stress <updates/s> <seconds> [thumbnails]
+ * forces the notification open and drives ntf_upd() (and optionally a
+ * screenshot per update) from a periodic timer, with a changing line in the
+ * body so every update is really sent. a report is printed at the end.
+ */
+static int cmp_int64(const void *a, const void *b)
 {
-    metadata_destroy();
-    metadata_avail = false;
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
 
-    if (event_prop->format != MPV_FORMAT_NODE)
+static void stress_report(void)
+{
+    int64_t wall = mono_ns() - stress.start_ns;
+    int64_t cpu = thread_cpu_ns() - stress.start_cpu_ns;
+    double secs = wall / 1e9;
+
+    qsort(stress.rtt_ns, stress.num_rtt, sizeof(*stress.rtt_ns), cmp_int64);
+    double pct[4] = {0};
+    const double at[4] = {0.5, 0.9, 0.99, 1};
+    for (int i = 0; i < 4 && stress.num_rtt; i++)
+        pct[i] = stress.rtt_ns[MIN(stress.num_rtt - 1,
+                (int)(at[i] * stress.num_rtt))] / 1e6;
+
+    log_print("stress: %" PRIu64 " updates in %.2f s (%.1f/s, %d/s "
+            "requested), %" PRIu64 " sends, %" PRIu64 " thumbnails",
+            stress.updates, secs, stress.updates / secs, stress.rate,
+            stress.sends, stress.thumbnails);
+    /* sched_add() zeroes overruns at the start of each run */
+    log_print("stress: dropped %" PRId64 " timer ticks, %" PRIu64
+            " superseded screenshots",
+            stress_timer.overruns, stress.superseded);
+    log_print("stress: Notify RTT p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, "
+            "max %.2f ms (%d samples)",
+            pct[0], pct[1], pct[2], pct[3], stress.num_rtt);
+    log_print("stress: plugin thread CPU %.1f ms (%.1f%% of wall time)",
+            cpu / 1e6, 100.0 * cpu / wall);
+}
+
+static void stress_stop(void)
+{
+    if (!stress.running)
         return;
 
-    struct mpv_node *node = event_prop->data;
+    sched_cancel(&stress_timer);
+    stress_report();
 
-    if (node->format != MPV_FORMAT_NODE_MAP)
+    free(stress.rtt_ns);
+    stress.rtt_ns = NULL;
+    stress.running = false;
+    force_open = stress.force_open_before;
+    rewrite_body = true;
+    done_actions |= A_NTF_UPD;
+    if (!force_open)
+        timer_arm();
+}
+
+static void on_stress_timer(__attribute__((unused)) struct sched_timer *t)
+{
+    if (mono_ns() >= stress.end_ns) {
+        stress_stop();
         return;
+    }
 
-    metadata_avail = true;
+    stress.updates++;
+    rewrite_body = true;
+    done_actions |= A_NTF_UPD;
+    if (stress.with_thumbnails)
+        done_actions |= A_FORCED_QUEUE_SHOT;
+}
 
-    mpv_node_list *list = node->u.list;
-    for (int i = 0; i < list->num; i++) {
-        char *key = list->keys[i];
-        mpv_node *value = &list->values[i];
+static void stress_start(const char *rate_str, const char *seconds_str,
+        bool with_thumbnails)
+{
+    long rate, seconds;
+    if (!strtolol(rate_str, &rate) || rate < 1 || rate > 1000 ||
+            !strtolol(seconds_str, &seconds) || seconds < 1 || seconds > 3600) {
+        ERR("stress: expected <updates/s> (1-1000) and <seconds> (1-3600)");
+        return;
+    }
 
-        if (value->format != MPV_FORMAT_STRING)
-            continue;
+    stress_stop();
 
-        if (!strcasecmp(key, "album")) {
-            if (!metadata[M_ALBUM])
-                metadata[M_ALBUM] = strdupesc(value->u.string);
-        } else if (!strcasecmp(key, "album_artist")) {
-            if (!metadata[M_ALBUM_ARTIST])
-                metadata[M_ALBUM_ARTIST] = strdupesc(value->u.string);
-        } else if (!strcasecmp(key, "artist")) {
-            if (!metadata[M_ARTIST])
-                metadata[M_ARTIST] = strdup(value->u.string);
-            if (!metadata[M_ARTIST__ESC])
-                metadata[M_ARTIST__ESC] = strdupesc(value->u.string);
-        } else if (!strcasecmp(key, "date")) {
-            if (!metadata[M_DATE])
-                metadata[M_DATE] = strdupesc(value->u.string);
-            if (!metadata[M_DATE__YEAREXT])
-                metadata[M_DATE__YEAREXT] = strdupescyear(value->u.string);
-        } else if (!strcasecmp(key, "disc")) {
-            if (!metadata[M_DISC])
-                metadata[M_DISC] = strdupesc(value->u.string);
-        } else if (!strcasecmp(key, "discc")) {
-            if (!metadata[M_DISCC])
-                metadata[M_DISCC] = strdupesc(value->u.string);
-        } else if (!strcasecmp(key, "discnumber")) {
-            if (!metadata[M_DISCNUMBER])
-                metadata[M_DISCNUMBER] = strdupesc(value->u.string);
-        } else if (!strcasecmp(key, "disctotal")) {
-            if (!metadata[M_DISCTOTAL])
-                metadata[M_DISCTOTAL] = strdupesc(value->u.string);
-        } else if (!strcasecmp(key, "originaldate")) {
-            if (!metadata[M_ORIGINALDATE])
-                metadata[M_ORIGINALDATE] = strdupesc(value->u.string);
-            if (!metadata[M_ORIGINALDATE__YEAREXT])
-                metadata[M_ORIGINALDATE__YEAREXT] = strdupescyear(value->u.string);
-        } else if (!strcasecmp(key, "originalyear")) {
-            if (!metadata[M_ORIGINALYEAR])
-                metadata[M_ORIGINALYEAR] = strdupesc(value->u.string);
-        } else if (!strcasecmp(key, "title")) {
-            if (!metadata[M_TITLE])
-                metadata[M_TITLE] = strdup(value->u.string);
-        } else if (!strcasecmp(key, "totaldiscs")) {
-            if (!metadata[M_TOTALDISCS])
-                metadata[M_TOTALDISCS] = strdupesc(value->u.string);
-        } else if (!strcasecmp(key, "year")) {
-            if (!metadata[M_YEAR])
-                metadata[M_YEAR] = strdupesc(value->u.string);
-        }
+    /* one sample per send, a few extra for updates from playback */
+    int max_rtt = MIN(rate * seconds + 1024, STRESS_MAX_RTT);
+    if (!(stress.rtt_ns = malloc(max_rtt * sizeof(*stress.rtt_ns))))
+        return;
+
+    stress.max_rtt = max_rtt;
+    stress.num_rtt = 0;
+    stress.rate = rate;
+    stress.with_thumbnails = with_thumbnails;
+    stress.updates = 0;
+    stress.sends = 0;
+    stress.thumbnails = 0;
+    stress.superseded = 0;
+    stress.force_open_before = force_open;
+    stress.start_ns = mono_ns();
+    stress.end_ns = stress.start_ns + seconds * NS_PER_SEC;
+    stress.start_cpu_ns = thread_cpu_ns();
+    stress.running = true;
+
+    force_open = true;
+    done_actions |= A_NTF_RST;
+    /* no slack, the rate is the point */
+    sched_add(&stress_timer, NS_PER_SEC / rate, NS_PER_SEC / rate, 0);
+    VERBOSE("stress: %ld updates/s for %ld s%s", rate, seconds,
+            with_thumbnails ? " with thumbnails" : "");
+}
+
+static void ntf_rst(void)
+{
+    DEBUG("notification reset");
+    bool timer_was_armed = timer_armed;
+    timer_arm();
+    visualizer_update();
+    if (!timer_was_armed) {
+        if (!thumbnail_fresh())
+            queue_screenshot(false);
+        else
+            stats_add(S_PRECAPTURE_HITS, 1);
     }
+    ntf_upd();
 }
 
-static void on_property_change(mpv_event *event)
+/*
+ * warm start: at shutdown, the summary, body and thumbnail of the current file
+ * are saved to a snapshot, which is mapped again at startup. if the first file
+ * that's loaded is the same one, the first notification is shown right away
+ * from the snapshot instead of waiting for metadata, time-pos and a screenshot,
+ * and then updated in place as usual once those arrive.
+ */
+#define SNAPSHOT_VERSION 1
+/* images larger than this (e.g. with disable_scaling) aren't saved */
+#define SNAPSHOT_MAX_IMAGE_SIZE 4 * 1024 * 1024
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t body_markup;
+    /* sizes include the NUL terminator, strings follow in this order */
+    uint32_t path_size;
+    uint32_t summary_size;
+    uint32_t body_size;
+    int32_t image_w;
+    int32_t image_h;
+    int32_t image_stride;
+    /* 0 if there's no image, otherwise image_stride * image_h */
+    uint32_t image_size;
+};
+
+static const char snapshot_magic[8] = "mpvnosd";
+
+static struct {
+    void *map;
+    size_t map_size;
+    const struct snapshot_header *header;
+    const char *path;
+    const char *summary;
+    const char *body;
+    const uint8_t *image;
+    /* the current file is the snapshot's file */
+    bool matched;
+} warm_start;
+
+static char *snapshot_path(void)
 {
-    mpv_event_property *event_prop = event->data;
-    struct observed_prop *prop = &observed_props[event->reply_userdata];
+    char path_to_expand[64];
+    snprintf(path_to_expand, sizeof(path_to_expand), "~~cache/%s.snapshot",
+            client_name);
+    const char *args[] = {"expand-path", path_to_expand, NULL};
 
-    save_prop(event, prop);
+    mpv_node path_node = {0};
+    char *path = NULL;
+    if (mpv_command_ret(hmpv, args, &path_node) == 0 &&
+            path_node.format == MPV_FORMAT_STRING)
+        path = strdup(path_node.u.string);
+    mpv_free_node_contents(&path_node);
+    return path;
+}
 
-    if (!prop->action_if_true || op_true(event->reply_userdata))
-        done_actions |= prop->action;
+static void warm_start_release(void)
+{
+    if (warm_start.map) {
+        munmap(warm_start.map, warm_start.map_size);
+        mem_add(MEM_SNAPSHOT, -(int64_t)warm_start.map_size);
+    }
+    memset(&warm_start, 0, sizeof(warm_start));
+}
 
-    if (prop->part_of_summary)
-        rewrite_summary = true;
-    if (prop->part_of_body)
-        rewrite_body = true;
+static bool snapshot_str_valid(const char *str, uint32_t size)
+{
+    return size > 0 && str[size - 1] == '\0';
+}
 
-    switch (event->reply_userdata) {
-        case P_APP_NAME:
-            ntf_set_app_name();
-            break;
-        case P_CHAPTER:
-        case P_CHAPTERS:
-            get_osd_str_chapter();
-            break;
-        case P_EDITION:
-        case P_EDITIONS:
-            get_osd_str_edition();
-            break;
-        case P_IDLE_ACTIVE:
-            ntf_set_progress_bar();
-            rewrite_body = true;
-            break;
-        case P_METADATA:
-            metadata_update(event_prop);
-            break;
-        case P_MOUSE_POS: {
-            bool old_mouse_hovered = mouse_hovered;
-            mouse_hovered = mouse_is_hovered(event_prop);
-            if (!old_mouse_hovered && mouse_hovered)
-                done_actions |= A_NTF_CLOSE;
-            break;
-        }
-        case P_MSG_LEVEL:
-            set_log_level(observed_props[P_MSG_LEVEL].node.u.string);
-            break;
-        case P_OPTIONS_SCRIPT_OPTS: {
-            struct mpv_node opts_previous[O_END] = {0};
-            opts_copy(opts_previous, opts);
-            opts_destroy(opts);
-            opts_copy(opts, opts_base);
-            if (event_prop->format == MPV_FORMAT_NODE)
-                opts_from_runtime(opts, event_prop->data);
-            opts_run_changed(opts_previous, opts);
-            opts_destroy(opts_previous);
-            break;
-        }
-        case P_PERCENT_POS: {
-            /*
-             * avoid constantly queueing screenshots for cover art. that means
-             * we have to make sure we otherwise detect if the image has changed
-             * (e.g. equalizer options), which probably won't be perfect
-             */
-            if (!op_true(P_CURRENT_TRACKS__VIDEO__IMAGE))
-                done_actions |= A_QUEUE_SHOT;
+static void warm_start_load(void)
+{
+    char *path = snapshot_path();
+    if (!path)
+        return;
 
-            long old_rounded = percent_pos_rounded;
-            if (op_avail(P_PERCENT_POS) && isnormal(observed_props[P_PERCENT_POS].node.u.double_))
-                percent_pos_rounded = lround(observed_props[P_PERCENT_POS].node.u.double_);
-            else
-                percent_pos_rounded = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd == -1)
+        return;
 
-            if (old_rounded != percent_pos_rounded) {
-                ntf_set_progress_bar();
-                done_actions |= A_NTF_UPD;
-                rewrite_body = true;
-            }
-            break;
-        }
-        case P_PLAYLIST_COUNT:
-        case P_PLAYLIST_POS:
-            ntf_set_progress_bar();
-            break;
-        case P_USER_DATA__DETECT_IMAGE__DETECTED:
-            ntf_set_progress_bar();
-            break;
-        default:
-            break;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    warm_start.map = map;
+    warm_start.map_size = st.st_size;
+    mem_add(MEM_SNAPSHOT, warm_start.map_size);
+
+    const struct snapshot_header *header = map;
+    uint64_t strings_size = (uint64_t)header->path_size + header->summary_size +
+        header->body_size;
+
+    if (memcmp(header->magic, snapshot_magic, sizeof(snapshot_magic)) ||
+            header->version != SNAPSHOT_VERSION ||
+            sizeof(*header) + strings_size + header->image_size != warm_start.map_size ||
+            (header->image_size && (header->image_w < 1 || header->image_h < 1 ||
+                header->image_stride < header->image_w * 4 ||
+                header->image_size != (uint64_t)header->image_stride * header->image_h)))
+        goto invalid;
+
+    warm_start.header = header;
+    warm_start.path = (const char *)(header + 1);
+    warm_start.summary = warm_start.path + header->path_size;
+    warm_start.body = warm_start.summary + header->summary_size;
+    if (header->image_size)
+        warm_start.image = (const uint8_t *)warm_start.body + header->body_size;
+
+    if (!snapshot_str_valid(warm_start.path, header->path_size) ||
+            !snapshot_str_valid(warm_start.summary, header->summary_size) ||
+            !snapshot_str_valid(warm_start.body, header->body_size))
+        goto invalid;
+
+    VERBOSE("loaded warm start snapshot for %s", warm_start.path);
+    return;
+
+invalid:
+    VERBOSE("ignoring invalid warm start snapshot");
+    warm_start_release();
+}
+
+static void warm_start_save(void)
+{
+    if (!opt_true(O_WARM_START) || !op_true(P_PATH) || !metadata_avail)
+        return;
+
+    char *path = snapshot_path();
+    if (!path)
+        return;
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    write_summary();
+    write_body();
+
+    const char *file_path = observed_props[P_PATH].node.u.string;
+    struct snapshot_header header = {
+        .version = SNAPSHOT_VERSION,
+        .body_markup = server_body_markup,
+        .path_size = strlen(file_path) + 1,
+        .summary_size = strlen(summary) + 1,
+        .body_size = strlen(body) + 1,
+    };
+    memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+
+    int64_t image_size = (int64_t)thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h;
+    if (thumbnail_ctx.thumbnail && image_size <= SNAPSHOT_MAX_IMAGE_SIZE) {
+        header.image_w = thumbnail_ctx.dst_w;
+        header.image_h = thumbnail_ctx.dst_h;
+        header.image_stride = thumbnail_ctx.dst_stride;
+        header.image_size = image_size;
     }
 
-    DEBUG("property changed, %s.", prop->name);
+    FILE *f = fopen(tmp_path, "we");
+    if (!f) {
+        VERBOSE("failed to write warm start snapshot: %m");
+        free(path);
+        return;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(file_path, header.path_size, 1, f) == 1 &&
+        fwrite(summary, header.summary_size, 1, f) == 1 &&
+        fwrite(body, header.body_size, 1, f) == 1 &&
+        (!header.image_size ||
+         fwrite(thumbnail_ctx.thumbnail, header.image_size, 1, f) == 1);
+    if (fclose(f) != 0)
+        ok = false;
+
+    if (!ok || rename(tmp_path, path) == -1) {
+        VERBOSE("failed to write warm start snapshot");
+        unlink(tmp_path);
+    } else {
+        VERBOSE("saved warm start snapshot");
+    }
+
+    free(path);
 }
 
-static void thumbnail_ctx_destroy(void)
+/* called when path changes, only the first file after startup can match */
+static void warm_start_check_path(void)
 {
-    if (thumbnail_ctx.thumbnail)
-        free(thumbnail_ctx.thumbnail);
-    if (thumbnail_ctx.pixbuf)
-        g_object_unref(thumbnail_ctx.pixbuf);
-    if (thumbnail_ctx.sws)
-        sws_freeContext(thumbnail_ctx.sws);
+    if (!warm_start.header || warm_start.matched || !op_true(P_PATH))
+        return;
 
-    memset(&thumbnail_ctx, 0, sizeof(thumbnail_ctx));
-    if (ntf)
-        ntf_set_image();
+    if (strcmp(observed_props[P_PATH].node.u.string, warm_start.path)) {
+        warm_start_release();
+        return;
+    }
 
-    VERBOSE("destroyed thumbnail context");
+    VERBOSE("warm start snapshot matches the current file");
+    warm_start.matched = true;
+
+    if (!warm_start.image || thumbnail_ctx.thumbnail ||
+            !opt_true(O_SEND_THUMBNAIL))
+        return;
+
+    /*
+     * src dimensions stay 0, so the context is configured again from the
+     * first real screenshot
+     */
+    if (!mem_reserve(warm_start.header->image_size) ||
+            !(thumbnail_ctx.thumbnail = malloc(warm_start.header->image_size)))
+        return;
+    mem_add(MEM_THUMBNAIL, warm_start.header->image_size);
+    memcpy(thumbnail_ctx.thumbnail, warm_start.image,
+            warm_start.header->image_size);
+    thumbnail_ctx.dst_w = warm_start.header->image_w;
+    thumbnail_ctx.dst_h = warm_start.header->image_h;
+    thumbnail_ctx.dst_stride = warm_start.header->image_stride;
+    ntf_set_image();
+    thumb_shm_publish();
 }
 
-static void thumbnail_ctx_maybe_new(double src_w, double src_h,
-        double src_stride)
+static void warm_start_show(void)
 {
-    if (src_w == thumbnail_ctx.src_w && src_h == thumbnail_ctx.src_h &&
-            (!opt_true(O_DISABLE_SCALING) ||
-             src_stride == thumbnail_ctx.src_stride)) {
-        /* we can keep the same ctx if only src stride changes with sws, but
-         * remember to update it before processing */
-        thumbnail_ctx.src_stride = src_stride;
+    if (!ntf_ensure() || warm_start.header->body_markup != server_body_markup) {
+        warm_start_release();
         return;
     }
 
-    thumbnail_ctx_destroy();
+    DEBUG("notification reset from warm start snapshot");
+    timer_arm();
+    notify_notification_update(ntf, warm_start.summary, warm_start.body, NULL);
+    /* replaced in place by the next update */
+    rewrite_summary = true;
+    rewrite_body = true;
+    ntf_show();
+    warm_start_release();
+}
 
-    thumbnail_ctx.src_w = src_w;
-    thumbnail_ctx.src_stride = src_stride;
-    thumbnail_ctx.src_h = src_h;
-    if (opt_true(O_DISABLE_SCALING)) {
-        thumbnail_ctx.dst_w = src_w;
-        thumbnail_ctx.dst_stride = src_stride;
-        thumbnail_ctx.dst_h = src_h;
-    } else {
-        double scaled_size = (double)opts[O_THUMBNAIL_SIZE].u.int64;
-        double ratio = fmin(scaled_size / src_w, scaled_size / src_h);
-        thumbnail_ctx.dst_w = MAX(1, (int)(src_w * ratio));
-        thumbnail_ctx.dst_stride = thumbnail_ctx.dst_w * 4;
-        thumbnail_ctx.dst_h = MAX(1, (int)(src_h * ratio));
-        thumbnail_ctx.sws = sws_getContext(src_w, src_h, AV_PIX_FMT_RGBA,
-                thumbnail_ctx.dst_w, thumbnail_ctx.dst_h, AV_PIX_FMT_RGBA,
-                opts[O_THUMBNAIL_SCALING].u.int64, NULL, NULL, NULL);
-        if (!thumbnail_ctx.sws) {
-            thumbnail_ctx_destroy();
-            return;
-        }
-    }
+/*
+ * thumbnail export: every new thumbnail is copied into a shared file at
+ * $XDG_RUNTIME_DIR/<client>-<pid>.thumb for other local consumers. the header
+ * is guarded by a seqlock: seq is odd while the writer is in the middle of an
+ * update, so readers copy what they need and retry if seq was odd or changed.
+ * the file only ever grows; readers remap when data_offset + capacity exceeds
+ * their mapping. a width of 0 means there is no thumbnail.
+ */
+#define THUMB_SHM_VERSION 1
+#define THUMB_SHM_DATA_OFFSET 64
+/* 'RGBA' as a little-endian fourcc, byte order R, G, B, A */
+#define THUMB_SHM_FORMAT_RGBA 0x41424752
+
+struct thumb_shm_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t data_offset;
+    _Atomic uint64_t seq;
+    uint64_t capacity;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+    /* CLOCK_MONOTONIC */
+    uint64_t timestamp_ns;
+};
 
-    int64_t alloc_size = thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h;
+static struct {
+    struct thumb_shm_header *header;
+    size_t map_size;
+    int fd;
+    char path[PATH_MAX];
+} thumb_shm = {.fd = -1};
 
-    if (alloc_size > MAX_IMAGE_SIZE) {
-        ERR("thumbnail output resolution is too large, disabling thumbnails");
-        thumbnail_ctx_destroy();
+static void thumb_shm_close(void)
+{
+    if (thumb_shm.fd == -1)
         return;
+
+    if (thumb_shm.header) {
+        munmap(thumb_shm.header, thumb_shm.map_size);
+        mem_add(MEM_THUMB_SHM, -(int64_t)thumb_shm.map_size);
     }
+    close(thumb_shm.fd);
+    unlink(thumb_shm.path);
+    thumb_shm.header = NULL;
+    thumb_shm.map_size = 0;
+    thumb_shm.fd = -1;
+    /* drops the path from the status sink */
+    done_actions |= A_NTF_UPD;
+}
 
-    thumbnail_ctx.thumbnail = malloc(alloc_size);
-    if (!thumbnail_ctx.thumbnail) {
-        thumbnail_ctx_destroy();
+static bool thumb_shm_reserve(size_t size)
+{
+    size_t map_size = THUMB_SHM_DATA_OFFSET + size;
+    if (map_size <= thumb_shm.map_size)
+        return true;
+
+    if (!mem_reserve(map_size - thumb_shm.map_size))
+        return false;
+
+    if (ftruncate(thumb_shm.fd, map_size) == -1) {
+        ERR("failed to size %s: %m", thumb_shm.path);
+        return false;
+    }
+
+    void *map = thumb_shm.header ?
+        mremap(thumb_shm.header, thumb_shm.map_size, map_size, MREMAP_MAYMOVE) :
+        mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, thumb_shm.fd, 0);
+    if (map == MAP_FAILED) {
+        ERR("failed to map %s: %m", thumb_shm.path);
+        /* a failed mremap leaves the old mapping, which this unmaps */
+        thumb_shm_close();
+        return false;
+    }
+
+    mem_add(MEM_THUMB_SHM, map_size - thumb_shm.map_size);
+    thumb_shm.header = map;
+    thumb_shm.map_size = map_size;
+    return true;
+}
+
+static void thumb_shm_open(void)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%d.thumb", (int)getpid());
+    if (!runtime_path(thumb_shm.path, sizeof(thumb_shm.path), suffix))
+        return;
+
+    thumb_shm.fd = open(thumb_shm.path,
+            O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (thumb_shm.fd == -1) {
+        ERR("failed to open %s: %m", thumb_shm.path);
         return;
     }
-    thumbnail_ctx.pixbuf = gdk_pixbuf_new_from_data(thumbnail_ctx.thumbnail,
-            GDK_COLORSPACE_RGB, true, 8, thumbnail_ctx.dst_w,
-            thumbnail_ctx.dst_h, thumbnail_ctx.dst_stride, NULL, NULL);
-    if (!thumbnail_ctx.pixbuf) {
-        thumbnail_ctx_destroy();
+
+    /* enough for the default thumbnail size without remapping */
+    if (!thumb_shm_reserve(64 * 64 * 4)) {
+        thumb_shm_close();
         return;
     }
 
-    /* this function is only called while ntf_image_enabled is true */
-    ntf_set_image();
-    VERBOSE("configured thumbnail context");
+    struct thumb_shm_header *h = thumb_shm.header;
+    h->version = THUMB_SHM_VERSION;
+    h->data_offset = THUMB_SHM_DATA_OFFSET;
+    h->capacity = thumb_shm.map_size - THUMB_SHM_DATA_OFFSET;
+    h->format = THUMB_SHM_FORMAT_RGBA;
+    /* readers check the magic last, once everything else is in place */
+    atomic_thread_fence(memory_order_release);
+    memcpy(h->magic, "mpvnthm", 8);
+    VERBOSE("exporting thumbnails to %s", thumb_shm.path);
 }
 
-static void thumbnail_ctx_process(void *data)
+/* publishes the current thumbnail, or the lack of one */
+static void thumb_shm_publish(void)
 {
-    if (!thumbnail_ctx.thumbnail)
+    if (thumb_shm.fd == -1)
         return;
 
-    struct timespec tp[2] = {0};
-    if (opt_true(O_PERFDATA))
-        clock_gettime(CLOCK_MONOTONIC, &tp[0]);
+    uint8_t *src = thumbnail_ctx.thumbnail;
+    size_t size = src ? (size_t)thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h : 0;
+    if (!thumb_shm_reserve(size))
+        return;
 
-    if (thumbnail_ctx.sws) {
-        const uint8_t *const src_slice[1] = {data};
-        const int src_stride[1] = {thumbnail_ctx.src_stride};
-        uint8_t *const dst[1] = {thumbnail_ctx.thumbnail};
-        const int dst_stride[1] = {thumbnail_ctx.dst_stride};
-        sws_scale(thumbnail_ctx.sws, src_slice, src_stride, 0,
-                thumbnail_ctx.src_h, dst, dst_stride);
-    } else {
-        memcpy(thumbnail_ctx.thumbnail, data,
-                thumbnail_ctx.dst_stride * thumbnail_ctx.dst_h);
-    }
+    struct thumb_shm_header *h = thumb_shm.header;
+    uint64_t seq = atomic_load_explicit(&h->seq, memory_order_relaxed);
+    atomic_store_explicit(&h->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    h->capacity = thumb_shm.map_size - THUMB_SHM_DATA_OFFSET;
+    h->width = src ? thumbnail_ctx.dst_w : 0;
+    h->height = src ? thumbnail_ctx.dst_h : 0;
+    h->stride = src ? thumbnail_ctx.dst_stride : 0;
+    h->timestamp_ns = mono_ns();
+    if (src)
+        memcpy((uint8_t *)h + THUMB_SHM_DATA_OFFSET, src, size);
+
+    atomic_store_explicit(&h->seq, seq + 2, memory_order_release);
+    stats_add(S_THUMB_SHM_PUBLISHED, 1);
+    /* lets the status sink tell its clients */
+    done_actions |= A_NTF_UPD;
+}
 
-    if (opt_true(O_PERFDATA)) {
-        clock_gettime(CLOCK_MONOTONIC, &tp[1]);
-        long in_ns[2];
-        in_ns[0] = tp[0].tv_sec * 1e9 + tp[0].tv_nsec;
-        in_ns[1] = tp[1].tv_sec * 1e9 + tp[1].tv_nsec;
-        pd_thumbnail = (in_ns[1] - in_ns[0]) / 1e3;
-        rewrite_body = true;
+static void thumb_shm_update(void)
+{
+    if (opt_true(O_THUMBNAIL_SHM) && thumb_shm.fd == -1) {
+        thumb_shm_open();
+        thumb_shm_publish();
+    } else if (!opt_true(O_THUMBNAIL_SHM) && thumb_shm.fd != -1) {
+        thumb_shm_close();
     }
+}
 
-    done_actions |= A_NTF_UPD;
+/* the seq of the last published thumbnail, 0 if not exporting */
+static uint64_t thumb_shm_seq(void)
+{
+    if (!thumb_shm.header)
+        return 0;
+    return atomic_load_explicit(&thumb_shm.header->seq, memory_order_relaxed);
 }
 
-static bool ntf_update_server_caps(void)
+/*
+ * QOI (https://qoiformat.org), a lossless image format which is simple and
+ * fast enough to keep cached thumbnails compressed: typically 2-4x smaller than
+ * RGBA, encoded and decoded at hundreds of MB/s. only 4 channel images are
+ * handled, which is all the cache stores.
+ */
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+
+union qoi_px {
+    uint8_t c[4];
+    uint32_t v;
+};
+
+static int qoi_hash(union qoi_px px)
 {
-    server_body_markup = false;
+    return (px.c[0] * 3 + px.c[1] * 5 + px.c[2] * 7 + px.c[3] * 11) % 64;
+}
 
-    GList *server_cap_list;
-    if (!(server_cap_list = notify_get_server_caps()))
-        return false;
+static void qoi_write_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
 
-    for (GList *l = server_cap_list; l; l = l->next) {
-        if (!strcmp(l->data, "body-markup")) {
-            server_body_markup = true;
-            g_free(l->data);
-            break;
+static uint32_t qoi_read_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* returns a malloc'd image and its size in out_size, or NULL */
+static uint8_t *qoi_encode(const uint8_t *rgba, int w, int h, int stride,
+        size_t *out_size)
+{
+    size_t max_size = QOI_HEADER_SIZE + (size_t)w * h * 5 + QOI_PADDING_SIZE;
+    uint8_t *out = malloc(max_size);
+    if (!out)
+        return NULL;
+
+    memcpy(out, "qoif", 4);
+    qoi_write_u32(out + 4, w);
+    qoi_write_u32(out + 8, h);
+    out[12] = 4;
+    /* sRGB with linear alpha */
+    out[13] = 0;
+    size_t p = QOI_HEADER_SIZE;
+
+    union qoi_px index[64] = {0};
+    union qoi_px prev = {.c = {0, 0, 0, 255}};
+    int run = 0;
+    for (int y = 0; y < h; y++) {
+        const uint8_t *row = rgba + (size_t)y * stride;
+        for (int x = 0; x < w; x++) {
+            union qoi_px px;
+            memcpy(px.c, row + x * 4, 4);
+
+            if (px.v == prev.v) {
+                if (++run == 62) {
+                    out[p++] = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run) {
+                out[p++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            int hash = qoi_hash(px);
+            if (index[hash].v == px.v) {
+                out[p++] = QOI_OP_INDEX | hash;
+            } else if (px.c[3] != prev.c[3]) {
+                index[hash] = px;
+                out[p++] = QOI_OP_RGBA;
+                memcpy(out + p, px.c, 4);
+                p += 4;
+            } else {
+                index[hash] = px;
+                int8_t vr = px.c[0] - prev.c[0];
+                int8_t vg = px.c[1] - prev.c[1];
+                int8_t vb = px.c[2] - prev.c[2];
+                int8_t vg_r = vr - vg;
+                int8_t vg_b = vb - vg;
+
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    out[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                        vg_b > -9 && vg_b < 8) {
+                    out[p++] = QOI_OP_LUMA | (vg + 32);
+                    out[p++] = (vg_r + 8) << 4 | (vg_b + 8);
+                } else {
+                    out[p++] = QOI_OP_RGB;
+                    memcpy(out + p, px.c, 3);
+                    p += 3;
+                }
+            }
+            prev = px;
         }
+    }
+    if (run)
+        out[p++] = QOI_OP_RUN | (run - 1);
 
-        g_free(l->data);
+    memset(out + p, 0, QOI_PADDING_SIZE - 1);
+    out[p + QOI_PADDING_SIZE - 1] = 1;
+    p += QOI_PADDING_SIZE;
+
+    /* shrinking doesn't fail in practice, but the larger block is fine too */
+    uint8_t *shrunk = realloc(out, p);
+    *out_size = p;
+    return shrunk ? shrunk : out;
+}
+
+/*
+ * decodes an image of exactly w x h into out, which has the given stride.
+ * returns false if the data is malformed
+ */
+static bool qoi_decode(const uint8_t *data, size_t size, uint8_t *out, int w,
+        int h, int stride)
+{
+    if (size < QOI_HEADER_SIZE + QOI_PADDING_SIZE || memcmp(data, "qoif", 4) ||
+            qoi_read_u32(data + 4) != (uint32_t)w ||
+            qoi_read_u32(data + 8) != (uint32_t)h || data[12] != 4)
+        return false;
+
+    size_t end = size - QOI_PADDING_SIZE;
+    size_t p = QOI_HEADER_SIZE;
+    union qoi_px index[64] = {0};
+    union qoi_px px = {.c = {0, 0, 0, 255}};
+    int run = 0;
+    for (int y = 0; y < h; y++) {
+        uint8_t *row = out + (size_t)y * stride;
+        for (int x = 0; x < w; x++) {
+            if (run) {
+                run--;
+            } else {
+                if (p >= end)
+                    return false;
+                int b1 = data[p++];
+
+                if (b1 == QOI_OP_RGB) {
+                    if (end - p < 3)
+                        return false;
+                    memcpy(px.c, data + p, 3);
+                    p += 3;
+                } else if (b1 == QOI_OP_RGBA) {
+                    if (end - p < 4)
+                        return false;
+                    memcpy(px.c, data + p, 4);
+                    p += 4;
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                    px = index[b1];
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                    px.c[0] += ((b1 >> 4) & 3) - 2;
+                    px.c[1] += ((b1 >> 2) & 3) - 2;
+                    px.c[2] += (b1 & 3) - 2;
+                } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                    if (p >= end)
+                        return false;
+                    int b2 = data[p++];
+                    int vg = (b1 & 0x3f) - 32;
+                    px.c[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+                    px.c[1] += vg;
+                    px.c[2] += vg - 8 + (b2 & 0x0f);
+                } else {
+                    run = b1 & 0x3f;
+                }
+                index[qoi_hash(px)] = px;
+            }
+
+            memcpy(row + x * 4, px.c, 4);
+        }
     }
 
-    VERBOSE("server supports markup? %d", server_body_markup);
-    g_list_free(server_cap_list);
     return true;
 }
 
 /*
- * enable or disable notification image support based on some criteria:
- * - disable if idling
- * - disable if there is no video track selected, unless a lavfi-complex is
- *   enabled or we're in the middle of switching tracks
- * - disable if send_thumbnail=no
- *
- * we have to turn it on/off ourselves instead of relying on an empty/error
- * screenshot to determine this, because when going from a video to no
- * video selected/idle player, screenshots actually still work and return the
- * image from the last displayed frame from the last played video.
+ * on-demand thumbnails for other scripts:
+ *   script-message thumbnail-at <time> <size> <reply-id> [<time> <size> <reply-id>...]
+ *   script-message thumbnail-cancel <reply-id>|*
+ * requests are answered with a broadcast
+ *   thumbnail-ready <reply-id> <path> <w> <h> <stride>
+ *   thumbnail-failed <reply-id> <reason>
+ * where path holds the raw RGBA pixels until THUMB_OUT_SLOTS more replies are
+ * written.
  *
- * we don't immediately queue a screenshot after enabling images because that
- * could yield a screenshot of the last frame of a previous video. if switching
- * video tracks or exiting idle mode, video reconfig should happen soon which
- * will queue a correct screnshot when the new video is ready. if instead
- * send_thumbnail was changed, that handler will have queued a screenshot.
+ * frames come from a cache of recent captures, keyed by their exact playback
+ * time, which is fed by both the notification and this service. they're kept
+ * QOI encoded, and the cache grows until memory_budget evicts from it, so the
+ * budget holds several times more of them than raw frames. a request which
+ * misses the cache is captured by the seek core (see thumb_seek), or for
+ * streams once playback gets close to its time. a single capture answers every
+ * waiting request near its time, scaling once per distinct size.
  */
-static void ntf_check_image(void)
+/* initial entries, and the most there can be without a memory_budget */
+#define THUMB_CACHE_MIN_LEN 32
+#define THUMB_CACHE_MAX_LEN 1024
+#define THUMB_CACHE_MAX_SIZE 512
+#define THUMB_REQ_MAX 64
+#define THUMB_REQ_TIMEOUT (60 * NS_PER_SEC)
+/* how far in seconds a frame may be from the requested time */
+#define THUMB_REQ_TOLERANCE 1.0
+#define THUMB_OUT_SLOTS 16
+
+struct thumb_cache_entry {
+    double time;
+    int size;
+    int w;
+    int h;
+    /* QOI encoded */
+    uint8_t *data;
+    size_t data_size;
+    uint64_t last_used;
+};
+
+struct thumb_req {
+    double time;
+    int size;
+    char *reply_id;
+    int64_t deadline;
+};
+
+static struct {
+    struct thumb_cache_entry *cache;
+    int cache_len;
+    uint64_t use_clock;
+    /* cache entries are stored at the largest size requested so far */
+    int cache_size;
+    struct thumb_req reqs[THUMB_REQ_MAX];
+    int num_reqs;
+    /* set by the first request, from then on notification frames are cached */
+    bool active;
+    bool capture_in_progress;
+    double capture_time;
+    int next_slot;
+    uint32_t slots_written;
+} thumb_service = {.cache_size = 128};
+
+static int64_t UD_THUMB_CAPTURE = 1002;
+
+static void thumb_reply(const char **args)
 {
-    bool switching_track = !op_true(P_IDLE_ACTIVE) && !op_avail(P_VID) &&
-        !metadata_avail;
+    /* fire and forget, the reply is ignored */
+    if (mpv_command_async(hmpv, 0, args) < 0)
+        ERR("failed to send %s", args[1]);
+}
 
-    if (op_true(P_IDLE_ACTIVE) || !opt_true(O_SEND_THUMBNAIL) ||
-            (!op_avail(P_VID) && !op_true(P_LAVFI_COMPLEX) && !switching_track)) {
-        if (ntf_image_enabled) {
-            VERBOSE("notification image disabled");
-            ntf_image_enabled = false;
-            thumbnail_ctx_destroy();
-            done_actions |= A_NTF_UPD;
-        }
-        return;
+static void thumb_req_fail(struct thumb_req *req, const char *reason)
+{
+    const char *args[] = {
+        "script-message", "thumbnail-failed", req->reply_id, reason, NULL
+    };
+    thumb_reply(args);
+}
+
+static void thumb_req_remove(int idx)
+{
+    free(thumb_service.reqs[idx].reply_id);
+    thumb_service.reqs[idx] = thumb_service.reqs[--thumb_service.num_reqs];
+}
+
+static bool thumb_out_path(char *buf, size_t size, int slot)
+{
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), "-%d-thumb%d.rgba", (int)getpid(), slot);
+    return runtime_path(buf, size, suffix);
+}
+
+/* writes pixels to the next output slot, returns false on failure */
+static bool thumb_out_write(const uint8_t *data, size_t size, char *path,
+        size_t path_size)
+{
+    int slot = thumb_service.next_slot;
+    char tmp[PATH_MAX];
+    if (!thumb_out_path(path, path_size, slot) ||
+            snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return false;
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        ERR("failed to open %s: %m", tmp);
+        return false;
     }
 
-    if (!ntf_image_enabled) {
-        VERBOSE("notification image enabled");
-        ntf_image_enabled = true;
+    bool ok = write(fd, data, size) == (ssize_t)size;
+    close(fd);
+    /* readers never see a partially written file */
+    if (!ok || rename(tmp, path) == -1) {
+        ERR("failed to write %s", path);
+        unlink(tmp);
+        return false;
     }
+
+    thumb_service.next_slot = (slot + 1) % THUMB_OUT_SLOTS;
+    thumb_service.slots_written |= 1u << slot;
+    return true;
 }
 
-static void ntf_set_progress_bar(void)
+/*
+ * answers every request within tolerance of entry's time. the entry is decoded
+ * at most once, and requests for the same size share one scaled image and
+ * output file
+ */
+static void thumb_serve(struct thumb_cache_entry *e)
 {
-    if (!ntf)
-        return;
+    /* the decoded entry, only needed when it has to be scaled down */
+    uint8_t *decoded = NULL;
 
-    if (op_true(P_IDLE_ACTIVE) || !opt_true(O_SEND_PROGRESS)) {
-        notify_notification_set_hint(ntf, "value", NULL);
-        return;
+    while (true) {
+        int size = 0;
+        for (int i = 0; i < thumb_service.num_reqs && !size; i++) {
+            struct thumb_req *req = &thumb_service.reqs[i];
+            if (fabs(req->time - e->time) <= THUMB_REQ_TOLERANCE &&
+                    req->size <= e->size)
+                size = req->size;
+        }
+        if (!size)
+            break;
+
+        double ratio = fmin(1, fmin((double)size / e->w, (double)size / e->h));
+        int w = MAX(1, (int)(e->w * ratio));
+        int h = MAX(1, (int)(e->h * ratio));
+        const char *error = NULL;
+        char path[PATH_MAX];
+
+        uint8_t *scaled = malloc((size_t)w * h * 4);
+        if (!scaled) {
+            error = "no-memory";
+        } else if (w == e->w && h == e->h) {
+            if (!qoi_decode(e->data, e->data_size, scaled, w, h, w * 4))
+                error = "decode-failed";
+        } else {
+            if (!decoded && (decoded = malloc((size_t)e->w * e->h * 4)) &&
+                    !qoi_decode(e->data, e->data_size, decoded, e->w, e->h,
+                        e->w * 4)) {
+                free(decoded);
+                decoded = NULL;
+            }
+            if (decoded)
+                scale_box(decoded, e->w, e->h, e->w * 4, scaled, w, h, w * 4);
+            else
+                error = "decode-failed";
+        }
+        if (!error && !thumb_out_write(scaled, (size_t)w * h * 4, path,
+                    sizeof(path)))
+            error = "write-failed";
+        free(scaled);
+
+        char w_str[16], h_str[16], stride_str[16];
+        snprintf(w_str, sizeof(w_str), "%d", w);
+        snprintf(h_str, sizeof(h_str), "%d", h);
+        snprintf(stride_str, sizeof(stride_str), "%d", w * 4);
+        for (int i = thumb_service.num_reqs - 1; i >= 0; i--) {
+            struct thumb_req *req = &thumb_service.reqs[i];
+            if (req->size != size ||
+                    fabs(req->time - e->time) > THUMB_REQ_TOLERANCE)
+                continue;
+
+            if (error) {
+                thumb_req_fail(req, error);
+            } else {
+                const char *args[] = {
+                    "script-message", "thumbnail-ready", req->reply_id, path,
+                    w_str, h_str, stride_str, NULL
+                };
+                thumb_reply(args);
+                stats_add(S_THUMB_SERVED, 1);
+            }
+            thumb_req_remove(i);
+        }
+    }
+
+    free(decoded);
+    e->last_used = ++thumb_service.use_clock;
+}
+
+static struct thumb_cache_entry *thumb_cache_find(double time, int size)
+{
+    struct thumb_cache_entry *best = NULL;
+    for (int i = 0; i < thumb_service.cache_len; i++) {
+        struct thumb_cache_entry *e = &thumb_service.cache[i];
+        if (e->data && e->size >= size &&
+                fabs(e->time - time) <= THUMB_REQ_TOLERANCE &&
+                (!best || fabs(e->time - time) < fabs(best->time - time)))
+            best = e;
     }
+    return best;
+}
+
+static int64_t thumb_cache_entry_size(struct thumb_cache_entry *e)
+{
+    return e->data ? (int64_t)e->data_size : 0;
+}
+
+static void thumb_cache_entry_free(struct thumb_cache_entry *e)
+{
+    mem_add(MEM_THUMB_CACHE, -thumb_cache_entry_size(e));
+    free(e->data);
+    *e = (struct thumb_cache_entry){0};
+}
+
+static void thumb_cache_clear(void)
+{
+    for (int i = 0; i < thumb_service.cache_len; i++)
+        thumb_cache_entry_free(&thumb_service.cache[i]);
+}
+
+/* doubles the number of entries, returns false if it can't grow */
+static bool thumb_cache_grow(void)
+{
+    int len = thumb_service.cache_len ? thumb_service.cache_len * 2 :
+        THUMB_CACHE_MIN_LEN;
+    if (len > THUMB_CACHE_MAX_LEN && opts[O_MEMORY_BUDGET].u.int64 == 0)
+        return false;
+
+    int64_t added = (int64_t)(len - thumb_service.cache_len) *
+        sizeof(struct thumb_cache_entry);
+    if (!mem_reserve(added))
+        return false;
+    struct thumb_cache_entry *cache = realloc(thumb_service.cache,
+            len * sizeof(*cache));
+    if (!cache)
+        return false;
+
+    memset(cache + thumb_service.cache_len, 0, added);
+    thumb_service.cache = cache;
+    thumb_service.cache_len = len;
+    mem_add(MEM_THUMB_CACHE, added);
+    return true;
+}
 
-    if (op_true(P_USER_DATA__DETECT_IMAGE__DETECTED)) {
-        if (op_avail(P_PLAYLIST_POS) && observed_props[P_PLAYLIST_COUNT].node.u.int64 > 1) {
-            double gallery_percent =
-                (observed_props[P_PLAYLIST_POS].node.u.int64 + 1) / (double)observed_props[P_PLAYLIST_COUNT].node.u.int64;
-            long gallery_percent_round = lround(gallery_percent * 100);
-            GVariant *v = g_variant_new("i", gallery_percent_round);
-            notify_notification_set_hint(ntf, "value", v);
-        } else {
-            notify_notification_set_hint(ntf, "value", NULL);
+/*
+ * for the memory governor. the victim is the entry with the largest size times
+ * age, so one big stale frame goes before several small recent ones
+ */
+static bool thumb_cache_evict(void)
+{
+    struct thumb_cache_entry *victim = NULL;
+    double victim_cost = 0;
+    for (int i = 0; i < thumb_service.cache_len; i++) {
+        struct thumb_cache_entry *e = &thumb_service.cache[i];
+        double cost = (double)thumb_cache_entry_size(e) *
+            (thumb_service.use_clock - e->last_used + 1);
+        if (e->data && cost > victim_cost) {
+            victim = e;
+            victim_cost = cost;
         }
-    } else {
-        GVariant *v = g_variant_new("i", percent_pos_rounded);
-        notify_notification_set_hint(ntf, "value", v);
     }
+
+    if (!victim)
+        return false;
+
+    thumb_cache_entry_free(victim);
+    return true;
 }
 
-static void ntf_set_urgency(void)
+/* stores a captured frame in the cache and answers waiting requests */
+static void thumb_service_frame(const uint8_t *data, int src_w, int src_h,
+        int src_stride, double time)
 {
-    if (!ntf)
+    /*
+     * replace a frame of the same time, or take a free entry. the cache only
+     * grows once it's full, and past THUMB_CACHE_MAX_LEN without a budget, the
+     * least recently used frame is replaced
+     */
+    int idx = -1, free_idx = -1, lru_idx = -1;
+    for (int i = 0; i < thumb_service.cache_len && idx == -1; i++) {
+        struct thumb_cache_entry *c = &thumb_service.cache[i];
+        if (c->data && c->time == time)
+            idx = i;
+        else if (!c->data && free_idx == -1)
+            free_idx = i;
+        else if (c->data && (lru_idx == -1 ||
+                    c->last_used < thumb_service.cache[lru_idx].last_used))
+            lru_idx = i;
+    }
+    if (idx == -1)
+        idx = free_idx;
+    if (idx == -1) {
+        /* growing may move the entries */
+        int len = thumb_service.cache_len;
+        idx = thumb_cache_grow() ? len : lru_idx;
+    }
+    if (idx == -1)
         return;
+    struct thumb_cache_entry *e = &thumb_service.cache[idx];
 
-    notify_notification_set_urgency(ntf, opts[O_NTF_URGENCY].u.int64);
+    int size = thumb_service.cache_size;
+    double ratio = fmin(1, fmin((double)size / src_w, (double)size / src_h));
+    int w = MAX(1, (int)(src_w * ratio));
+    int h = MAX(1, (int)(src_h * ratio));
+
+    thumb_cache_entry_free(e);
+
+    /* the scaled frame and the worst case encoder output, while encoding */
+    int64_t raw_size = (int64_t)w * h * 4;
+    int64_t work_size = raw_size + QOI_HEADER_SIZE + (int64_t)w * h * 5 +
+        QOI_PADDING_SIZE;
+    if (!mem_reserve(work_size))
+        return;
+    uint8_t *buf = malloc(raw_size);
+    if (!buf)
+        return;
+    mem_add(MEM_THUMB_CACHE, work_size);
+    scale_box(data, src_w, src_h, src_stride, buf, w, h, w * 4);
+
+    size_t encoded_size;
+    uint8_t *encoded = qoi_encode(buf, w, h, w * 4, &encoded_size);
+    free(buf);
+    mem_add(MEM_THUMB_CACHE, -work_size);
+    if (!encoded)
+        return;
+    mem_add(MEM_THUMB_CACHE, encoded_size);
+    stats_add(S_THUMB_CACHE_RAW, (int64_t)w * h * 4);
+    stats_add(S_THUMB_CACHE_ENCODED, encoded_size);
+
+    *e = (struct thumb_cache_entry){
+        .time = time,
+        /* an unscaled frame is as good as it gets for any size */
+        .size = ratio < 1 ? size : THUMB_CACHE_MAX_SIZE,
+        .w = w,
+        .h = h,
+        .data = encoded,
+        .data_size = encoded_size,
+    };
+    thumb_serve(e);
 }
 
-static void ntf_set_category(void)
+/* stores the frame of a screenshot-raw reply, captured at time */
+static void thumb_service_capture_done(mpv_event *event, double time)
 {
-    if (!ntf)
+    mpv_event_command *event_command = event->data;
+    if (event->error < 0 ||
+            event_command->result.format != MPV_FORMAT_NODE_MAP)
         return;
 
-    if (opt_true(O_NTF_CATEGORY)) {
-        notify_notification_set_category(ntf, opts[O_NTF_CATEGORY].u.string);
-    } else {
-        /* notify_notification_set_category doesn't unset if you pass NULL */
-        notify_notification_set_hint(ntf, "category", NULL);
+    mpv_byte_array *ba = NULL;
+    int64_t w = 0, h = 0, stride = 0;
+    mpv_node_list *list = event_command->result.u.list;
+    for (int i = 0; i < list->num; i++) {
+        mpv_node *value = &list->values[i];
+        if (!strcmp(list->keys[i], "data"))
+            ba = value->u.ba;
+        else if (!strcmp(list->keys[i], "w"))
+            w = value->u.int64;
+        else if (!strcmp(list->keys[i], "h"))
+            h = value->u.int64;
+        else if (!strcmp(list->keys[i], "stride"))
+            stride = value->u.int64;
     }
+
+    if (ba && w && h && stride)
+        thumb_service_frame(ba->data, w, h, stride, time);
 }
 
-static void ntf_set_app_name(void)
+/*
+ * the seek core: requests which playback isn't close to are captured by a
+ * second, headless mpv core with the same file loaded, paused and without
+ * audio or subtitles, which is seeked exactly to each request's time in turn.
+ * it's only used for local video files, since a stream would be fetched twice,
+ * and it doesn't have the player's filters or equalizer. it's destroyed when
+ * the file changes, or after THUMB_SEEK_IDLE without requests. when the file
+ * can't be loaded, requests wait for playback instead.
+ */
+#define THUMB_SEEK_IDLE (30 * NS_PER_SEC)
+/* a seek and capture which takes longer fails the requests near its time */
+#define THUMB_SEEK_TIMEOUT (5 * NS_PER_SEC)
+
+static struct {
+    mpv_handle *h;
+    int fd;
+    /* the file is loaded, and the core can seek */
+    bool loaded;
+    /* a seek and capture for time is in flight */
+    bool busy;
+    bool capturing;
+    double time;
+    int64_t busy_since;
+    /* the current file couldn't be loaded */
+    bool failed;
+} thumb_seek = {.fd = -1};
+
+/* reply userdata on the seek core's own handle */
+static int64_t UD_SEEK = 1;
+static int64_t UD_SEEK_CAPTURE = 2;
+
+static void thumb_seek_close(void)
 {
-    if (!notify_is_initted())
+    if (!thumb_seek.h)
         return;
 
-    if (op_true(P_APP_NAME))
-        notify_set_app_name(observed_props[P_APP_NAME].node.u.string);
-    else
-        notify_set_app_name("mpv");
+    mpv_terminate_destroy(thumb_seek.h);
+    thumb_seek.h = NULL;
+    thumb_seek.fd = -1;
+    thumb_seek.loaded = false;
+    thumb_seek.busy = false;
+    thumb_seek.capturing = false;
+    VERBOSE("closed the thumbnail seek core");
 }
 
-static void ntf_set_app_icon(void)
+static void on_thumb_seek_idle_timer(__attribute__((unused)) struct sched_timer *t)
 {
-    if (!notify_is_initted())
-        return;
-
-    if (opt_true(O_NTF_APP_ICON))
-        notify_set_app_icon(opts[O_NTF_APP_ICON].u.string);
-    else
-        notify_set_app_icon(NULL);
+    if (!thumb_service.num_reqs)
+        thumb_seek_close();
 }
 
-static void ntf_close(void)
+static struct sched_timer thumb_seek_idle_timer = {
+    .name = "thumbnail-seek-idle",
+    .cb = on_thumb_seek_idle_timer,
+};
+
+static void thumb_seek_open(void)
 {
-    if (!ntf)
+    if (!(thumb_seek.h = mpv_create())) {
+        thumb_seek.failed = true;
         return;
+    }
 
-    DEBUG("notification close");
-    GError *gerr = NULL;
-    if (!notify_notification_close(ntf, &gerr)) {
-        ERR("failed to close notification: %s", gerr->message);
-        g_error_free(gerr);
+    static const char *const options[][2] = {
+        {"config", "no"},
+        {"load-scripts", "no"},
+        {"ytdl", "no"},
+        {"idle", "yes"},
+        {"vo", "null"},
+        {"ao", "null"},
+        {"aid", "no"},
+        {"sid", "no"},
+        {"pause", "yes"},
+        {"keep-open", "always"},
+        {"hr-seek", "yes"},
+        {"cache", "no"},
+    };
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+        mpv_set_option_string(thumb_seek.h, options[i][0], options[i][1]);
+
+    const char *args[] = {
+        "loadfile", observed_props[P_PATH].node.u.string, NULL
+    };
+    if (mpv_initialize(thumb_seek.h) < 0 ||
+            (thumb_seek.fd = mpv_get_wakeup_pipe(thumb_seek.h)) == -1 ||
+            mpv_command_async(thumb_seek.h, 0, args) < 0) {
+        ERR("failed to start the thumbnail seek core");
+        thumb_seek_close();
+        thumb_seek.failed = true;
+        return;
     }
+    VERBOSE("started the thumbnail seek core");
 }
 
-static void ntf_set_image(void)
+/* seeks to the first request which playback isn't already close to */
+static void thumb_seek_next(void)
 {
-    if (!ntf)
+    if (!thumb_seek.loaded || thumb_seek.busy)
         return;
 
-    notify_notification_set_image_from_pixbuf(ntf, thumbnail_ctx.pixbuf);
+    double now = op_avail(P_TIME_POS) ?
+        observed_props[P_TIME_POS].node.u.int64 : -INFINITY;
+    struct thumb_req *req = NULL;
+    for (int i = 0; i < thumb_service.num_reqs && !req; i++) {
+        if (fabs(thumb_service.reqs[i].time - now) > THUMB_REQ_TOLERANCE)
+            req = &thumb_service.reqs[i];
+    }
+    if (!req)
+        return;
+
+    char time_str[32];
+    snprintf(time_str, sizeof(time_str), "%.6f", req->time);
+    const char *args[] = {"seek", time_str, "absolute+exact", NULL};
+    if (mpv_command_async(thumb_seek.h, UD_SEEK, args) < 0)
+        return;
+
+    thumb_seek.busy = true;
+    thumb_seek.capturing = false;
+    thumb_seek.time = req->time;
+    thumb_seek.busy_since = mono_ns();
 }
 
-static void ntf_uninit(void)
+/*
+ * ends the seek and capture in flight. requests near its time which the
+ * capture didn't answer fail, rather than being seeked to again
+ */
+static void thumb_seek_done(void)
 {
-    ntf_close();
-    if (ntf) {
-        g_object_unref(ntf);
-        ntf = NULL;
+    for (int i = thumb_service.num_reqs - 1; i >= 0; i--) {
+        if (fabs(thumb_service.reqs[i].time - thumb_seek.time) <=
+                THUMB_REQ_TOLERANCE) {
+            thumb_req_fail(&thumb_service.reqs[i], "capture-failed");
+            thumb_req_remove(i);
+        }
     }
-    if (notify_is_initted())
-        notify_uninit();
+
+    thumb_seek.busy = false;
+    thumb_seek.capturing = false;
+    thumb_seek_next();
+    if (!thumb_service.num_reqs)
+        sched_add(&thumb_seek_idle_timer, THUMB_SEEK_IDLE, 0, NS_PER_SEC);
 }
 
-static void ntf_init(void)
+/* starts or continues out-of-band captures for the waiting requests */
+static void thumb_seek_request(void)
 {
-    if (!notify_init("mpv")) {
-        ERR("notify_init() failed");
-        return;
-    }
-
-    if (!ntf_update_server_caps()) {
-        ERR("failed to get server caps");
-        ntf_uninit();
+    if (thumb_seek.failed || !op_avail(P_PATH) || !op_avail(P_VID) ||
+            op_true(P_CURRENT_TRACKS__VIDEO__IMAGE) ||
+            op_true(P_LAVFI_COMPLEX))
         return;
-    }
-
-    ntf_set_app_name();
-    ntf_set_app_icon();
 
-    if (!(ntf = notify_notification_new(summary, body, NULL))) {
-        ERR("failed to create notification");
-        ntf_uninit();
+    const char *path = observed_props[P_PATH].node.u.string;
+    if (strstr(path, "://") && strncmp(path, "file://", 7))
         return;
-    }
-    notify_notification_set_timeout(ntf, NOTIFY_EXPIRES_NEVER);
 
-    ntf_set_progress_bar();
-    ntf_set_category();
-    ntf_set_urgency();
-    ntf_set_image();
+    sched_cancel(&thumb_seek_idle_timer);
+    if (thumb_seek.busy && mono_ns() - thumb_seek.busy_since > THUMB_SEEK_TIMEOUT)
+        thumb_seek_done();
+    else if (!thumb_seek.h)
+        thumb_seek_open();
+    else
+        thumb_seek_next();
 }
 
-static void write_summary(void)
+static void thumb_seek_dispatch(void)
 {
-    DEBUG("writing summary");
-    if (metadata[M_ARTIST] && metadata[M_TITLE]) {
-        snprintf(summary_store, sizeof(summary_store), "%s - %s",
-                metadata[M_ARTIST], metadata[M_TITLE]);
-        summary = summary_store;
-    } else if (op_true(P_MEDIA_TITLE)) {
-        summary = observed_props[P_MEDIA_TITLE].node.u.string;
-    } else {
-        summary = "No file";
+    char drain[256];
+    (void)!read(thumb_seek.fd, drain, sizeof(drain));
+
+    while (thumb_seek.h) {
+        mpv_event *event = mpv_wait_event(thumb_seek.h, 0);
+        switch (event->event_id) {
+            case MPV_EVENT_NONE:
+                return;
+            case MPV_EVENT_SHUTDOWN:
+                thumb_seek_close();
+                return;
+            case MPV_EVENT_END_FILE: {
+                mpv_event_end_file *end_file = event->data;
+                if (end_file->reason == MPV_END_FILE_REASON_ERROR) {
+                    VERBOSE("the thumbnail seek core couldn't load the file");
+                    thumb_seek_close();
+                    thumb_seek.failed = true;
+                    return;
+                }
+                break;
+            }
+            case MPV_EVENT_PLAYBACK_RESTART:
+                if (!thumb_seek.loaded) {
+                    thumb_seek.loaded = true;
+                    thumb_seek_next();
+                } else if (thumb_seek.busy && !thumb_seek.capturing) {
+                    const char *args[] = {"screenshot-raw", "video", "rgba", NULL};
+                    if (mpv_command_async(thumb_seek.h, UD_SEEK_CAPTURE, args) < 0)
+                        thumb_seek_done();
+                    else
+                        thumb_seek.capturing = true;
+                }
+                break;
+            case MPV_EVENT_COMMAND_REPLY:
+                if (event->reply_userdata == (uint64_t)UD_SEEK &&
+                        event->error < 0) {
+                    thumb_seek_done();
+                } else if (event->reply_userdata == (uint64_t)UD_SEEK_CAPTURE) {
+                    /* hr-seek lands on the frame at the requested time */
+                    thumb_service_capture_done(event, thumb_seek.time);
+                    thumb_seek_done();
+                }
+                break;
+            default:
+                break;
+        }
     }
 }
 
-static void seconds_to_hhmmss(int64_t total_sec, char *buf, size_t size)
+/* the exact playback time, time-pos is only observed in whole seconds */
+static double thumb_service_time(void)
 {
-    int hours = total_sec / 3600;
-    int minutes = (total_sec % 3600) / 60;
-    int seconds = total_sec % 60;
-    snprintf(buf, size, "%02d:%02d:%02d", hours, minutes, seconds);
+    double time;
+    if (!thumb_service.active ||
+            mpv_get_property(hmpv, "time-pos", MPV_FORMAT_DOUBLE, &time) < 0)
+        return observed_props[P_TIME_POS].node.u.int64;
+    return time;
 }
 
-#define APPEND(...) { \
-    body_count += snprintf(body + body_count, sizeof(body) - body_count, __VA_ARGS__); \
-    if (body_count >= sizeof(body)) { return; } \
+static void on_thumb_req_timer(struct sched_timer *t)
+{
+    int64_t now = mono_ns();
+    for (int i = thumb_service.num_reqs - 1; i >= 0; i--) {
+        if (thumb_service.reqs[i].deadline <= now) {
+            thumb_req_fail(&thumb_service.reqs[i], "timeout");
+            thumb_req_remove(i);
+        }
+    }
+
+    if (!thumb_service.num_reqs)
+        sched_cancel(t);
+    else
+        thumb_seek_request();
 }
 
-static void write_body(void)
+static struct sched_timer thumb_req_timer = {
+    .name = "thumbnail-requests",
+    .cb = on_thumb_req_timer,
+};
+
+/* captures a frame if playback is close to a waiting request */
+static void thumb_service_check(void)
 {
-    DEBUG("writing body");
+    if (!thumb_service.num_reqs)
+        return;
 
-    size_t body_count = 0;
+    /* the others go to the seek core */
+    thumb_seek_request();
+    if (thumb_service.capture_in_progress || !op_avail(P_TIME_POS) ||
+            (!op_avail(P_VID) && !op_true(P_LAVFI_COMPLEX)))
+        return;
 
-    /* L1: playback indicators and progress */
+    double now = observed_props[P_TIME_POS].node.u.int64;
+    bool wanted = false;
+    for (int i = 0; i < thumb_service.num_reqs && !wanted; i++)
+        wanted = fabs(thumb_service.reqs[i].time - now) <= THUMB_REQ_TOLERANCE;
+    if (!wanted)
+        return;
 
-    if (op_avail(P_PLAYLIST_POS) &&
-            observed_props[P_PLAYLIST_COUNT].node.u.int64 > 1) {
-        if (op_avail(P_LOOP_PLAYLIST) &&
-                strcmp(observed_props[P_LOOP_PLAYLIST].node.u.string, "no")) {
-            APPEND("🔁 ");
-        }
-        APPEND("(%02" PRId64 "/%02" PRId64 ") ",
-                observed_props[P_PLAYLIST_POS].node.u.int64 + 1,
-                observed_props[P_PLAYLIST_COUNT].node.u.int64);
+    const char *args[] = {
+        "screenshot-raw", opt_node(O_SCREENSHOT_FLAGS)->u.string, "rgba", NULL
+    };
+    if (mpv_command_async(hmpv, UD_THUMB_CAPTURE, args) == 0) {
+        thumb_service.capture_in_progress = true;
+        thumb_service.capture_time = thumb_service_time();
     }
+}
 
-    if (op_true(P_PAUSED_FOR_CACHE) || op_true(P_SEEKING)) {
-        APPEND("⏲");
-    } else if (op_true(P_PAUSE)) {
-        APPEND("⏸");
-    } else if (op_true(P_PLAY_DIRECTION) &&
-            !strcmp(observed_props[P_PLAY_DIRECTION].node.u.string, "backward")) {
-        APPEND("◀");
-    } else {
-        APPEND("▶");
+static void thumb_service_request(const char *time_str, const char *size_str,
+        const char *reply_id)
+{
+    char *end;
+    double time = strtod(time_str, &end);
+    long size;
+    struct thumb_req req = {.reply_id = (char *)reply_id};
+    if (*end || !isfinite(time) || !strtolol(size_str, &size) || size < 1 ||
+            size > THUMB_CACHE_MAX_SIZE) {
+        thumb_req_fail(&req, "bad-request");
+        return;
     }
 
-    if (!op_true(P_IDLE_ACTIVE) && !op_true(P_USER_DATA__DETECT_IMAGE__DETECTED) &&
-            op_avail(P_TIME_POS)) {
-        char com_time_time[16];
-        seconds_to_hhmmss(observed_props[P_TIME_POS].node.u.int64,
-                com_time_time, sizeof(com_time_time));
+    /* a repeated reply id replaces the earlier request */
+    for (int i = 0; i < thumb_service.num_reqs; i++) {
+        if (!strcmp(thumb_service.reqs[i].reply_id, reply_id)) {
+            thumb_req_remove(i);
+            break;
+        }
+    }
 
-        if (op_avail(P_DURATION)) {
-            char com_time_duration[16];
-            seconds_to_hhmmss(observed_props[P_DURATION].node.u.int64,
-                    com_time_duration, sizeof(com_time_duration));
+    if (thumb_service.num_reqs == THUMB_REQ_MAX) {
+        thumb_req_fail(&req, "busy");
+        return;
+    }
 
-            APPEND(" %s / %s (%d%%)", com_time_time, com_time_duration,
-                    (int)percent_pos_rounded);
-        } else {
-            APPEND(" %s (%d%%)", com_time_time, (int)percent_pos_rounded);
-        }
+    if (!(req.reply_id = strdup(reply_id)))
+        return;
+    thumb_service.active = true;
+    req.time = time;
+    req.size = size;
+    req.deadline = mono_ns() + THUMB_REQ_TIMEOUT;
+    thumb_service.reqs[thumb_service.num_reqs++] = req;
+    stats_add(S_THUMB_REQUESTS, 1);
+
+    if (size > thumb_service.cache_size)
+        thumb_service.cache_size = size;
+
+    struct thumb_cache_entry *e = thumb_cache_find(time, size);
+    if (e) {
+        stats_add(S_THUMB_CACHE_HITS, 1);
+        thumb_serve(e);
+        return;
+    }
 
-        if (op_avail(P_LOOP_FILE) &&
-                strcmp(observed_props[P_LOOP_FILE].node.u.string, "no")) {
-            APPEND(" 🔁");
+    if (!sched_pending(&thumb_req_timer))
+        sched_add(&thumb_req_timer, NS_PER_SEC, NS_PER_SEC, NS_PER_SEC);
+}
+
+static void thumb_service_cancel(const char *reply_id)
+{
+    bool all = !strcmp(reply_id, "*");
+    for (int i = thumb_service.num_reqs - 1; i >= 0; i--) {
+        if (all || !strcmp(thumb_service.reqs[i].reply_id, reply_id)) {
+            thumb_req_fail(&thumb_service.reqs[i], "cancelled");
+            thumb_req_remove(i);
         }
     }
+}
 
-    if (op_avail(P_SPEED) && observed_props[P_SPEED].node.u.double_ != 1) {
-        APPEND(" (%.2fx)", observed_props[P_SPEED].node.u.double_);
+static void on_thumb_message(mpv_event_client_message *event_cm)
+{
+    if (!strcmp(event_cm->args[0], "thumbnail-cancel")) {
+        for (int i = 1; i < event_cm->num_args; i++)
+            thumb_service_cancel(event_cm->args[i]);
+        return;
     }
 
-    if (op_true(P_MUTE)) {
-        APPEND(" 🔇");
-    }
+    for (int i = 1; i + 2 < event_cm->num_args; i += 3)
+        thumb_service_request(event_cm->args[i], event_cm->args[i + 1],
+                event_cm->args[i + 2]);
+    if ((event_cm->num_args - 1) % 3)
+        VERBOSE("ignoring incomplete thumbnail-at request");
 
-    if (op_avail(P_VOLUME) && observed_props[P_VOLUME].node.u.int64 != 100) {
-        APPEND(" (🔊 %" PRId64 "%%)", observed_props[P_VOLUME].node.u.int64);
+    /* a batch of requests only needs one check */
+    thumb_service_check();
+}
+
+static void on_done_thumb_capture(mpv_event *event)
+{
+    thumb_service.capture_in_progress = false;
+    thumb_service_capture_done(event, thumb_service.capture_time);
+}
+
+/* frames from another file are useless, and so are requests for them */
+static void thumb_service_reset(void)
+{
+    for (int i = thumb_service.num_reqs - 1; i >= 0; i--) {
+        thumb_req_fail(&thumb_service.reqs[i], "file-changed");
+        thumb_req_remove(i);
     }
+    thumb_cache_clear();
+    thumb_seek_close();
+    thumb_seek.failed = false;
+}
 
-    if (!op_avail(P_IMAGE_DISPLAY_DURATION) ||
-            !isnormal(observed_props[P_IMAGE_DISPLAY_DURATION].node.u.double_)) {
-        if (!op_true(P_USER_DATA__DETECT_IMAGE__DETECTED) && op_true(P_KEEP_OPEN) &&
-                strcmp(observed_props[P_KEEP_OPEN].node.u.string, "always")) {
-            APPEND(" (auto)");
-        }
-    } else if (op_true(P_USER_DATA__DETECT_IMAGE__DETECTED)) {
-        APPEND(" (ss: %.0fs)", observed_props[P_IMAGE_DISPLAY_DURATION].node.u.double_);
+static void thumb_service_close(void)
+{
+    for (int i = thumb_service.num_reqs - 1; i >= 0; i--)
+        thumb_req_remove(i);
+    thumb_seek_close();
+    thumb_cache_clear();
+    mem_add(MEM_THUMB_CACHE,
+            -(int64_t)thumb_service.cache_len * sizeof(struct thumb_cache_entry));
+    free(thumb_service.cache);
+    thumb_service.cache = NULL;
+    thumb_service.cache_len = 0;
+
+    char path[PATH_MAX];
+    for (int slot = 0; slot < THUMB_OUT_SLOTS; slot++) {
+        if (thumb_service.slots_written & (1u << slot) &&
+                thumb_out_path(path, sizeof(path), slot))
+            unlink(path);
     }
+}
 
-    /* TODO: don't use OSD formatting, compose it ourself */
+/*
+ * status sink: a unix socket at $XDG_RUNTIME_DIR/<client>-<pid>.sock which
+ * pushes a JSON line with the summary, body lines, progress and pause state to
+ * every connected client whenever they change, and the current one on connect.
+ * each client has a bounded queue of shared messages; when a slow reader's
+ * queue is full, its oldest unsent message is dropped, so the plugin never
+ * blocks on a reader.
+ */
+#define SINK_VERSION 1
+#define SINK_MAX_CLIENTS 16
+#define SINK_QUEUE_LEN 8
+
+struct sink_msg {
+    int refs;
+    size_t len;
+    char data[];
+};
 
-    /* L2: chapter title and position, if there is more than one chapter */
+struct sink_client {
+    int fd;
+    /* ring of queued messages, the head one may be partially sent */
+    struct sink_msg *queue[SINK_QUEUE_LEN];
+    int head;
+    int count;
+    size_t head_sent;
+};
 
-    if (osd_str_chapter && osd_str_chapters)
-        APPEND("\nChapter: %s / %s", osd_str_chapter, osd_str_chapters);
+static struct {
+    int listen_fd;
+    char path[PATH_MAX];
+    struct sink_client clients[SINK_MAX_CLIENTS];
+    int num_clients;
+    /* the last published message and the part of it without the seq */
+    struct sink_msg *last;
+    char *last_content;
+    uint64_t seq;
+    /* something may have changed while nobody was connected */
+    bool stale;
+} sink = {.listen_fd = -1};
+
+static void sink_msg_unref(struct sink_msg *msg)
+{
+    if (msg && --msg->refs == 0) {
+        mem_add(MEM_SINK, -(int64_t)(sizeof(*msg) + msg->len + 1));
+        free(msg);
+    }
+}
 
-    /* L3: edition title and position, if there is more than one edition */
+static struct sink_msg *sink_client_msg(struct sink_client *c, int i)
+{
+    return c->queue[(c->head + i) % SINK_QUEUE_LEN];
+}
 
-    if (osd_str_edition && osd_str_editions)
-        APPEND("\nEdition: %s / %s", osd_str_edition, osd_str_editions);
+static void sink_client_drop(int idx)
+{
+    struct sink_client *c = &sink.clients[idx];
+    close(c->fd);
+    for (int i = 0; i < c->count; i++)
+        sink_msg_unref(sink_client_msg(c, i));
+
+    sink.clients[idx] = sink.clients[--sink.num_clients];
+    stats_set(S_SINK_CLIENTS, sink.num_clients);
+    DEBUG("status sink client disconnected");
+}
 
-    /* L4: release information, if available */
+static void sink_client_push(struct sink_client *c, struct sink_msg *msg)
+{
+    if (c->count == SINK_QUEUE_LEN) {
+        /* drop the oldest message, unless it's partially sent */
+        int victim = c->head_sent ? 1 : 0;
+        sink_msg_unref(sink_client_msg(c, victim));
+        for (int i = victim; i < c->count - 1; i++)
+            c->queue[(c->head + i) % SINK_QUEUE_LEN] = sink_client_msg(c, i + 1);
+        c->count--;
+        stats_add(S_SINK_DROPPED, 1);
+    }
 
-    const char *album_artist_txt = metadata[M_ALBUM_ARTIST];
-    if (!album_artist_txt) album_artist_txt = metadata[M_ARTIST__ESC];
+    msg->refs++;
+    c->queue[(c->head + c->count++) % SINK_QUEUE_LEN] = msg;
+}
 
-    if (metadata[M_ALBUM]) {
-        const char *date_txt = metadata[M_ORIGINALYEAR];
-        if (!date_txt) date_txt = metadata[M_ORIGINALDATE__YEAREXT];
-        if (!date_txt) date_txt = metadata[M_YEAR];
-        if (!date_txt) date_txt = metadata[M_DATE__YEAREXT];
+/* returns false if the client should be dropped */
+static bool sink_client_flush(struct sink_client *c)
+{
+    while (c->count) {
+        struct sink_msg *msg = c->queue[c->head];
+        ssize_t n = send(c->fd, msg->data + c->head_sent,
+                msg->len - c->head_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+        c->head_sent += n;
+        if (c->head_sent < msg->len)
+            continue;
 
-        APPEND("\n");
-        if (album_artist_txt)
-            APPEND("%s - ", album_artist_txt);
-        APPEND("%s", metadata[M_ALBUM]);
-        if (date_txt)
-            APPEND(" (%s)", date_txt);
-    } else {
-        const char *date_txt = metadata[M_ORIGINALYEAR];
-        if (!date_txt) date_txt = metadata[M_ORIGINALDATE];
-        if (!date_txt) date_txt = metadata[M_YEAR];
-        if (!date_txt) date_txt = metadata[M_DATE];
-        if (date_txt) APPEND("\nDate: %s", date_txt);
+        sink_msg_unref(msg);
+        c->head = (c->head + 1) % SINK_QUEUE_LEN;
+        c->count--;
+        c->head_sent = 0;
     }
 
-    /* L5: disc position, for multi-disc releases */
+    return true;
+}
 
-    const char *totaldiscs_txt = metadata[M_TOTALDISCS];
-    if (!totaldiscs_txt) totaldiscs_txt = metadata[M_DISCTOTAL];
-    if (!totaldiscs_txt) totaldiscs_txt = metadata[M_DISCC];
-    const char *disc_txt = metadata[M_DISC];
-    if (!disc_txt) disc_txt = metadata[M_DISCNUMBER];
+static char *json_append_str(char *out, const char *in)
+{
+    *out++ = '"';
+    for (; *in; in++) {
+        unsigned char c = *in;
+        switch (c) {
+            case '"':
+                out = stpcpy(out, "\\\"");
+                break;
+            case '\\':
+                out = stpcpy(out, "\\\\");
+                break;
+            case '\n':
+                out = stpcpy(out, "\\n");
+                break;
+            case '\t':
+                out = stpcpy(out, "\\t");
+                break;
+            default:
+                if (c < 0x20)
+                    out += sprintf(out, "\\u%04x", c);
+                else
+                    *out++ = c;
+                break;
+        }
+    }
+    *out++ = '"';
+    *out = '\0';
+    return out;
+}
 
-    if (disc_txt && totaldiscs_txt &&
-            strcmp(totaldiscs_txt, "0") &&
-            strcmp(totaldiscs_txt, "1"))
-        APPEND("\nDisc: %s / %s", disc_txt, totaldiscs_txt);
+/* returns a new message if the state changed since the last one */
+static struct sink_msg *sink_build(void)
+{
+    compose_text();
 
-    /* L6: an additional message */
+    /* worst case every byte becomes a \u escape */
+    char *content = malloc((strlen(summary) + strlen(body) +
+                strlen(thumb_shm.path)) * 6 + 256);
+    if (!content)
+        return NULL;
 
-    const char *body_exttxt = NULL;
+    char *out = stpcpy(content, "\"summary\":");
+    out = json_append_str(out, summary);
+    out = stpcpy(out, ",\"body\":[");
 
-    if (op_true(P_EOF_REACHED) && op_avail(P_PLAYLIST_POS) &&
-            observed_props[P_PLAYLIST_COUNT].node.u.int64 > 0 &&
-            observed_props[P_PLAYLIST_POS].node.u.int64 >= 0) {
-        if (observed_props[P_PLAYLIST_COUNT].node.u.int64 > 1 &&
-                observed_props[P_PLAYLIST_POS].node.u.int64 + 1 == observed_props[P_PLAYLIST_COUNT].node.u.int64)
-            body_exttxt = "end of playlist";
-        else
-            body_exttxt = "EOF";
+    const char *line = body;
+    char line_buf[sizeof(body)];
+    while (true) {
+        const char *eol = strchrnul(line, '\n');
+        memcpy(line_buf, line, eol - line);
+        line_buf[eol - line] = '\0';
+        out = json_append_str(out, line_buf);
+        if (!*eol)
+            break;
+        *out++ = ',';
+        line = eol + 1;
     }
 
-    if (body_exttxt) {
-        if (server_body_markup) {
-            APPEND("\n<b>%s</b>", body_exttxt);
-        } else {
-            APPEND("\n%s", body_exttxt);
-        }
+    long progress;
+    if (get_progress(&progress))
+        out += sprintf(out, "],\"progress\":%ld", progress);
+    else
+        out = stpcpy(out, "],\"progress\":null");
+
+    out += sprintf(out, ",\"paused\":%s,\"idle\":%s,\"markup\":%s",
+            op_true(P_PAUSE) ? "true" : "false",
+            op_true(P_IDLE_ACTIVE) ? "true" : "false",
+            server_body_markup ? "true" : "false");
+
+    if (thumb_shm.header) {
+        out = stpcpy(out, ",\"thumbnail\":{\"path\":");
+        out = json_append_str(out, thumb_shm.path);
+        sprintf(out, ",\"seq\":%" PRIu64 "}", thumb_shm_seq());
+    } else {
+        stpcpy(out, ",\"thumbnail\":null");
     }
 
-    /* L7: perfdata */
+    if (sink.last_content && !strcmp(sink.last_content, content)) {
+        free(content);
+        return NULL;
+    }
 
-    if (opt_true(O_PERFDATA)) {
-        APPEND("\nThumbnail postprocess timing (last µs): %ld", pd_thumbnail);
-        APPEND("\nPrevious ntf show rtt (µs): %ld", pd_show);
+    size_t size = strlen(content) + 64;
+    struct sink_msg *msg = malloc(sizeof(*msg) + size);
+    if (!msg) {
+        free(content);
+        return NULL;
     }
 
-    /* L8: current subtitle/lyric text, if any */
+    msg->refs = 1;
+    msg->len = snprintf(msg->data, size, "{\"v\":%d,\"seq\":%" PRIu64 ",%s}\n",
+            SINK_VERSION, ++sink.seq, content);
+    mem_add(MEM_SINK, sizeof(*msg) + msg->len + 1);
 
-    if (opt_true(O_SEND_SUB_TEXT) && op_true(P_SUB_TEXT) && op_true(P_SUB_VISIBILITY))
-        APPEND("\n%s", observed_props[P_SUB_TEXT].node.u.string);
+    free(sink.last_content);
+    sink.last_content = content;
+    sink_msg_unref(sink.last);
+    sink.last = msg;
+    return msg;
 }
 
-/*
- * if the notification server is restarted while mpv is running, show/close will
- * start failing with 'ServiceUnknown: The name is not activatable'. the only
- * way to reset libnotify's global dbus proxy is to uninit and reinit the whole
- * library.
-*/
-static void ntf_reinit(void)
+static void sink_publish(void)
 {
-    ntf_uninit();
-    ntf_init();
-    if (ntf) {
-        /*
-         * unobserve and reobserve all properties if server_body_markup changed
-         * so that affected properties get escaping added/removed, but also
-         * generally to retry showing the notification (this will also reset the
-         * timer, but that's ok)
-         */
-        for (size_t i = 0; i < sizeof(observed_props) / sizeof(observed_props[0]); i++) {
-            if (!mpv_has_app_name && i == P_APP_NAME)
-                continue;
+    if (sink.listen_fd == -1)
+        return;
 
-            if (mpv_unobserve_property(hmpv, i) < 0)
-                ERR("failed to unobserve property: %s", observed_props[i].name);
+    if (!sink.num_clients) {
+        sink.stale = true;
+        return;
+    }
 
-            if (mpv_observe_property(hmpv, i, observed_props[i].name, observed_props[i].format) != 0)
-                ERR("failed to observe property: %s", observed_props[i].name);
-        }
+    sink.stale = false;
+    struct sink_msg *msg = sink_build();
+    if (!msg)
+        return;
+
+    stats_add(S_SINK_PUBLISHED, 1);
+    for (int i = sink.num_clients - 1; i >= 0; i--) {
+        sink_client_push(&sink.clients[i], msg);
+        if (!sink_client_flush(&sink.clients[i]))
+            sink_client_drop(i);
     }
 }
 
-static void ntf_upd(void)
+static void sink_accept(void)
 {
-    if (!ntf) {
-        ntf_reinit();
+    int fd = accept4(sink.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    if (sink.num_clients == SINK_MAX_CLIENTS) {
+        VERBOSE("too many status sink clients");
+        close(fd);
         return;
     }
 
-    if (rewrite_summary)
-        write_summary();
-    if (rewrite_body)
-        write_body();
+    if (sink.stale || !sink.last) {
+        sink.stale = false;
+        sink_build();
+    }
 
-    DEBUG("sending notification");
-    if (rewrite_summary || rewrite_body)
-        notify_notification_update(ntf, summary, body, NULL);
+    int idx = sink.num_clients++;
+    sink.clients[idx] = (struct sink_client){.fd = fd};
+    stats_set(S_SINK_CLIENTS, sink.num_clients);
+    DEBUG("status sink client connected");
 
-    rewrite_summary = false;
-    rewrite_body = false;
+    if (sink.last) {
+        sink_client_push(&sink.clients[idx], sink.last);
+        if (!sink_client_flush(&sink.clients[idx]))
+            sink_client_drop(idx);
+    }
+}
 
-    GError *gerr = NULL;
+static void sink_close(void)
+{
+    if (sink.listen_fd == -1)
+        return;
 
-    struct timespec tp[2] = {0};
-    if (opt_true(O_PERFDATA))
-        clock_gettime(CLOCK_MONOTONIC, &tp[0]);
+    while (sink.num_clients)
+        sink_client_drop(sink.num_clients - 1);
 
-    if (!notify_notification_show(ntf, &gerr)) {
-        ERR("failed to show notification: %s", gerr->message);
-        g_error_free(gerr);
-        ntf_reinit();
-    }
+    close(sink.listen_fd);
+    unlink(sink.path);
+    sink_msg_unref(sink.last);
+    free(sink.last_content);
 
-    if (opt_true(O_PERFDATA)) {
-        clock_gettime(CLOCK_MONOTONIC, &tp[1]);
-        long in_ns[2];
-        in_ns[0] = tp[0].tv_sec * 1e9 + tp[0].tv_nsec;
-        in_ns[1] = tp[1].tv_sec * 1e9 + tp[1].tv_nsec;
-        pd_show = (in_ns[1] - in_ns[0]) / 1e3;
-        rewrite_body = true;
-    }
+    sink.listen_fd = -1;
+    sink.last = NULL;
+    sink.last_content = NULL;
+    sink.stale = false;
 }
 
-/*
- * screenshots shouldn't usually happen while the expire timer isn't armed, but
- * we allow it to be forced when a video reconfig happens so that we have a
- * screenshot of the current file's cover art (or first frame of a video) ready
- * so that opening a notification doesn't briefly flicker with an image from a
- * different album or mpv icon.
- */
-static void queue_screenshot(bool force)
+static void sink_open(void)
 {
-    if (!ntf_image_enabled || (!timer_armed && (!force && !force_open)))
-        return;
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%d.sock", (int)getpid());
 
-    if (screenshot_in_progress) {
-#if 0
-        VERBOSE("aborting current screenshot command");
-        mpv_abort_async_command(hmpv, UD_SCREENSHOT);
-#endif
-        screenshot_in_progress = false;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (!runtime_path(sink.path, sizeof(addr.sun_path), suffix)) {
+        ERR("status socket path is too long");
+        return;
     }
+    memcpy(addr.sun_path, sink.path, strlen(sink.path) + 1);
 
-    const char *screenshot_args[] = {
-        "screenshot-raw", opts[O_SCREENSHOT_FLAGS].u.string, "rgba", NULL
-    };
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        ERR("failed to create status socket: %m");
+        return;
+    }
 
-    int mpv_err;
-    if (!(mpv_err = mpv_command_async(hmpv, UD_SCREENSHOT, screenshot_args))) {
-        screenshot_in_progress = true;
-        DEBUG("queued screenshot");
-    } else {
-        ERR("failed to queue screenshot: %d", mpv_err);
+    /* left behind by a crashed instance which had the same pid */
+    unlink(sink.path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(fd, SINK_MAX_CLIENTS) == -1) {
+        ERR("failed to listen on %s: %m", sink.path);
+        close(fd);
+        return;
     }
+
+    sink.listen_fd = fd;
+    sink.stale = true;
+    VERBOSE("status socket listening on %s", sink.path);
 }
 
-static void ntf_rst(void)
+static void sink_update(void)
 {
-    DEBUG("notification reset");
-    bool timer_was_armed = timer_armed;
-    timer_disarm();
-    struct itimerspec new_value = {.it_value.tv_sec = opts[O_EXPIRE_TIMEOUT].u.int64};
-    timerfd_settime(timer_fd, 0, &new_value, 0);
-    timer_armed = true;
-    if (!timer_was_armed)
-        queue_screenshot(false);
-    ntf_upd();
+    if (opt_true(O_STATUS_SOCKET) && sink.listen_fd == -1)
+        sink_open();
+    else if (!opt_true(O_STATUS_SOCKET) && sink.listen_fd != -1)
+        sink_close();
 }
 
-static bool player_considered_focused(void)
+/* fills in pollfds for the listening socket and clients, returns the count */
+static int sink_poll_fds(struct pollfd *pfd)
 {
-    return (op_true(P_FOCUSED) || mouse_hovered || opt_true(O_FOCUS_MANUAL));
+    if (sink.listen_fd == -1)
+        return 0;
+
+    pfd[0] = (struct pollfd){.fd = sink.listen_fd, .events = POLLIN};
+    for (int i = 0; i < sink.num_clients; i++) {
+        pfd[i + 1] = (struct pollfd){
+            .fd = sink.clients[i].fd,
+            .events = POLLIN | (sink.clients[i].count ? POLLOUT : 0),
+        };
+    }
+    return sink.num_clients + 1;
+}
+
+static void sink_dispatch(struct pollfd *pfd, int nfds)
+{
+    if (!nfds)
+        return;
+
+    /*
+     * in reverse so that dropping a client (which moves the last one into its
+     * slot) doesn't skip anything
+     */
+    for (int i = MIN(nfds - 1, sink.num_clients); i >= 1; i--) {
+        struct sink_client *c = &sink.clients[i - 1];
+        short revents = pfd[i].revents;
+        bool keep = !(revents & (POLLERR | POLLHUP | POLLNVAL));
+
+        if (keep && revents & POLLIN) {
+            /* clients aren't expected to send anything */
+            char drain[256];
+            ssize_t n = recv(c->fd, drain, sizeof(drain), MSG_DONTWAIT);
+            keep = n > 0 || (n == -1 && (errno == EAGAIN || errno == EINTR));
+        }
+
+        if (keep && revents & POLLOUT)
+            keep = sink_client_flush(c);
+
+        if (!keep)
+            sink_client_drop(i - 1);
+    }
+
+    if (pfd[0].revents & POLLIN)
+        sink_accept();
 }
 
 static void done(void)
@@ -1779,17 +6140,34 @@ static void done(void)
     if (done_actions & A_NTF_CHECK_IMAGE)
         ntf_check_image();
 
+    if (done_actions & A_NTF_RST)
+        lease_acquire();
+
+    if (!lease_owned()) {
+        if (!lease_dormant) {
+            VERBOSE("another instance owns the notification, going dormant");
+            lease_dormant = true;
+            force_open = false;
+            timer_disarm();
+            ntf_close();
+        }
+        goto finished;
+    }
+
+    if (done_actions & A_EQ) {
+        if (eq_apply()) {
+            done_actions |= A_NTF_UPD;
+            thumb_shm_publish();
+        } else {
+            done_actions |= A_QUEUE_SHOT;
+        }
+    }
+
     if (done_actions & A_FORCED_QUEUE_SHOT)
         queue_screenshot(true);
     else if (done_actions & A_QUEUE_SHOT)
         queue_screenshot(false);
 
-    if (done_actions & A_NTF_CLOSE && !force_open) {
-        timer_disarm();
-        ntf_close();
-        goto finished;
-    }
-
     /*
      * when metadata is unavailable and the player isn't idle, the track is
      * switching. just wait until metadata is ready, because otherwise the
@@ -1799,14 +6177,33 @@ static void done(void)
      *
      * also maybe check that time-pos is ready?
      */
-    if ((!player_considered_focused() || force_open) && ((metadata_avail && op_avail(P_TIME_POS)) ||
-                    op_true(P_IDLE_ACTIVE))) {
+    bool ready = (metadata_avail && op_avail(P_TIME_POS)) ||
+        op_true(P_IDLE_ACTIVE);
+
+    /* any change to the text comes with one of these */
+    if (ready && done_actions & (A_NTF_RST | A_NTF_UPD))
+        sink_publish();
+
+    if (done_actions & A_NTF_CLOSE && !force_open) {
+        timer_disarm();
+        ntf_close();
+        goto finished;
+    }
+
+    if ((!player_considered_focused() || force_open) && ready) {
         if (done_actions & A_NTF_RST)
             ntf_rst();
         else if (done_actions & A_NTF_UPD && (timer_armed || force_open))
             ntf_upd();
+    } else if ((!player_considered_focused() || force_open) &&
+            warm_start.matched && done_actions & A_NTF_RST) {
+        warm_start_show();
     }
 
+    /* the snapshot isn't needed anymore once the real state is ready */
+    if (ready && warm_start.map)
+        warm_start_release();
+
 finished:
     done_actions = 0;
     DEBUG("back to sleep ~");
@@ -1856,6 +6253,14 @@ static void on_done_screenshot(mpv_event *event)
 
     thumbnail_ctx_maybe_new(i_w, i_h, i_stride);
     thumbnail_ctx_process(i_ba->data);
+    thumbnail_time = thumbnail_ctx.thumbnail ? screenshot_time : -1;
+    if (stress.running)
+        stress.thumbnails++;
+    if (thumbnail_ctx.thumbnail)
+        thumb_shm_publish();
+    if (thumb_service.active)
+        thumb_service_frame(i_ba->data, i_w, i_h, i_stride,
+                screenshot_time_exact);
 }
 
 static void on_client_message(mpv_event *event)
@@ -1871,6 +6276,18 @@ static void on_client_message(mpv_event *event)
     } else if (!strcmp(event_cm->args[0], "open")) {
         done_actions |= A_NTF_RST;
         force_open = true;
+    } else if (!strcmp(event_cm->args[0], "thumbnail-at") ||
+            !strcmp(event_cm->args[0], "thumbnail-cancel")) {
+        on_thumb_message(event_cm);
+    } else if (!strcmp(event_cm->args[0], "stress")) {
+        if (event_cm->num_args >= 2 && !strcmp(event_cm->args[1], "stop"))
+            stress_stop();
+        else if (event_cm->num_args >= 3)
+            stress_start(event_cm->args[1], event_cm->args[2],
+                    event_cm->num_args >= 4 &&
+                    !strcmp(event_cm->args[3], "thumbnails"));
+        else
+            ERR("usage: stress <updates/s> <seconds> [thumbnails] | stress stop");
     } else if (!strcmp(event_cm->args[0], "reload-config")) {
         struct mpv_node opts_previous[O_END] = {0};
         struct mpv_node script_opts_node = {0};
@@ -1890,16 +6307,26 @@ static void on_client_message(mpv_event *event)
     }
 }
 
+/*
+ * returns -1 on shutdown, otherwise the number of events other than replies to
+ * log batches, which need no further work
+ */
 static int dispatch_mpv_events(void)
 {
     char drain[4096];
     (void)!read(wakeup_pipe[0], drain, sizeof(drain));
 
-    while (true) {
+    int log_replies = 0;
+    for (int drained = 0; ; drained++) {
         mpv_event *event = mpv_wait_event(hmpv, 0);
         switch (event->event_id) {
             case MPV_EVENT_NONE:
-                return 0;
+                watch_event_queue(drained);
+                return drained - log_replies;
+            case MPV_EVENT_QUEUE_OVERFLOW:
+                ERR("the event queue overflowed, events were lost");
+                stats_add(S_EVENT_QUEUE_OVERFLOWS, 1);
+                break;
             case MPV_EVENT_SHUTDOWN:
                 return -1;
             case MPV_EVENT_VIDEO_RECONFIG:
@@ -1916,7 +6343,14 @@ static int dispatch_mpv_events(void)
                 done_actions |= A_NTF_RST;
                 break;
             case MPV_EVENT_COMMAND_REPLY:
-                on_done_screenshot(event);
+                if (event->reply_userdata == (uint64_t)UD_SCREENSHOT)
+                    on_done_screenshot(event);
+                else if (event->reply_userdata == (uint64_t)UD_THUMB_CAPTURE)
+                    on_done_thumb_capture(event);
+                else if (event->reply_userdata == (uint64_t)UD_LOG) {
+                    log_batch.inflight--;
+                    log_replies++;
+                }
                 break;
             case MPV_EVENT_CLIENT_MESSAGE:
                 on_client_message(event);
@@ -1937,36 +6371,19 @@ static void wakeup_mpv_events(__attribute__((unused)) void *d)
 
 static void check_prop_support(void)
 {
-    mpv_has_app_name = false;
-
-    mpv_node property_list_node = {0};
-    if (mpv_get_property(hmpv, "property-list", MPV_FORMAT_NODE,
-                &property_list_node) != 0)
-        return;
-
-    if (property_list_node.format != MPV_FORMAT_NODE_ARRAY)
-        return;
-
-    mpv_node_list *list = property_list_node.u.list;
-    for (int i = 0; i < list->num; i++) {
-        mpv_node *value = &list->values[i];
-
-        if (value->format != MPV_FORMAT_STRING)
-            continue;
-
-        if (!strcmp(value->u.string, observed_props[P_APP_NAME].name)) {
-            mpv_free_node_contents(&property_list_node);
-            mpv_has_app_name = true;
-            return;
-        }
-    }
-
-    mpv_free_node_contents(&property_list_node);
+    /* only the error matters, which is cheaper than scanning property-list */
+    mpv_node app_name_node = {0};
+    int mpv_err = mpv_get_property(hmpv, observed_props[P_APP_NAME].name,
+            MPV_FORMAT_NODE, &app_name_node);
+    mpv_has_app_name = mpv_err != MPV_ERROR_PROPERTY_NOT_FOUND;
+    if (mpv_err == 0)
+        mpv_free_node_contents(&app_name_node);
 }
 
 int mpv_open_cplugin(mpv_handle *mpv)
 {
     int rc = -1;
+    int64_t start = mono_ns();
     hmpv = mpv;
     client_name = mpv_client_name(hmpv);
 
@@ -1989,13 +6406,19 @@ int mpv_open_cplugin(mpv_handle *mpv)
     write_summary();
     write_body();
 
-    ntf_init();
-
     opts_from_file(opts);
+    triggers_compile();
     opts_run_changed(opts_defaults, opts);
     done_actions = 0;
     opts_copy(opts_base, opts);
 
+    if (opt_true(O_WARM_START))
+        warm_start_load();
+    lease_update();
+    sink_update();
+    thumb_shm_update();
+    metrics_update();
+
     check_prop_support();
     for (size_t i = 0; i < sizeof(observed_props) / sizeof(observed_props[0]); i++) {
         if (!mpv_has_app_name && i == P_APP_NAME)
@@ -2007,42 +6430,105 @@ int mpv_open_cplugin(mpv_handle *mpv)
 
     mpv_set_wakeup_callback(hmpv, wakeup_mpv_events, NULL);
 
-    struct pollfd pfd[2] = {
-        {.fd = wakeup_pipe[0],  .events = POLLIN},
-        {.fd = timer_fd,        .events = POLLIN},
-    };
+    sched_add(&ntf_init_timer, NS_PER_SEC / 2, 0, NS_PER_SEC / 2);
+    cpu_update();
+    stats_set(S_STARTUP_US, (mono_ns() - start) / 1000);
 
     while (true) {
-        if (poll(pfd, 2, -1) == -1) {
+        struct pollfd pfd[2 + 1 + SINK_MAX_CLIENTS + 1] = {
+            {.fd = wakeup_pipe[0],  .events = POLLIN},
+            {.fd = timer_fd,        .events = POLLIN},
+        };
+        int sink_nfds = sink_poll_fds(pfd + 2);
+        int nfds = 2 + sink_nfds;
+        if (thumb_seek.fd != -1)
+            pfd[nfds++] = (struct pollfd){.fd = thumb_seek.fd, .events = POLLIN};
+
+        /* idle work only runs when nothing else is ready */
+        int ready = poll(pfd, nfds, refine.pending ? 0 : -1);
+        if (ready == -1) {
             ERR("poll() failed: %m");
             break;
         }
 
+        watch_iter_begin();
+
+        if (!ready) {
+            watch_push(W_REFINE);
+            refine_run();
+            watch_pop();
+        }
+
+        /*
+         * an iteration woken only by replies to log batches has nothing to do.
+         * going through done() would log, and flushing that would be answered
+         * by another reply, so at msg-level=debug the loop would never sleep
+         */
+        bool log_replies_only = false;
         if (pfd[0].revents & POLLIN) {
-            if (dispatch_mpv_events() == -1) {
+            watch_push(W_EVENTS);
+            int dispatch_rc = dispatch_mpv_events();
+            watch_pop();
+            if (dispatch_rc == -1) {
                 rc = 0;
                 break;
             }
+            log_replies_only = !dispatch_rc && ready == 1 && !done_actions;
         } else if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
             ERR("error or hangup on wakeup pipe read fd");
             break;
         }
 
         if (pfd[1].revents & POLLIN) {
-            char drain[4096];
-            (void)!read(timer_fd, drain, sizeof(drain));
-            DEBUG("expire timer expired");
-            done_actions |= A_NTF_CLOSE;
+            watch_push(W_TIMERS);
+            sched_run();
+            watch_pop();
         } else if (pfd[1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
             ERR("error or hangup on timerfd");
             break;
         }
 
+        watch_push(W_SINK);
+        sink_dispatch(pfd + 2, sink_nfds);
+        watch_pop();
+
+        /* the core may have been closed by a file change meanwhile */
+        if (nfds > 2 + sink_nfds && pfd[2 + sink_nfds].revents & POLLIN &&
+                thumb_seek.h) {
+            watch_push(W_EVENTS);
+            thumb_seek_dispatch();
+            watch_pop();
+        }
+
+        if (log_replies_only) {
+            watch_iter_end();
+            /* only what was held back while too many batches were in flight */
+            log_flush(false);
+            continue;
+        }
+
+        watch_push(W_DONE);
         done();
+        watch_pop();
+
+        watch_iter_end();
+        mem_maybe_trim();
+        log_flush(false);
     }
 
 done:
+    if (rc == 0)
+        warm_start_save();
+    warm_start_release();
+    stress_stop();
+    lease_close();
+    sink_close();
+    thumb_shm_close();
+    thumb_service_close();
+    metrics_close();
+
     thumbnail_ctx_destroy();
+    thumbnail_libs_unload();
 
     ntf_uninit();
 
@@ -2069,5 +6555,6 @@ done:
             close(wakeup_pipe[i]);
     }
 
+    log_flush(true);
     return rc;
 }
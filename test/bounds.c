@@ -0,0 +1,328 @@
+/*
+ * checks that pathological text inputs (huge playlists, multi-megabyte tags,
+ * long subtitle lines, hundreds of chapters) stay within time and allocation
+ * bounds on the paths that handle them: save_prop(), metadata_update(),
+ * strdupesc(), write_summary() and write_body().
+ *
+ * the plugin is included directly and built against the declarations in
+ * test/stubs, with the mpv, GLib and libnotify functions it links against
+ * stubbed out below. allocations made by the plugin are counted by redefining
+ * malloc() and friends before it's included.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <math.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct {
+    int64_t calls;
+    int64_t bytes;
+} allocs;
+
+static void *count_malloc(size_t size)
+{
+    allocs.calls++;
+    allocs.bytes += size;
+    return malloc(size);
+}
+
+static void *count_realloc(void *p, size_t size)
+{
+    allocs.calls++;
+    allocs.bytes += size;
+    return realloc(p, size);
+}
+
+static char *count_strdup(const char *s)
+{
+    allocs.calls++;
+    allocs.bytes += strlen(s) + 1;
+    return strdup(s);
+}
+
+static char *count_strndup(const char *s, size_t n)
+{
+    allocs.calls++;
+    allocs.bytes += strnlen(s, n) + 1;
+    return strndup(s, n);
+}
+
+#define malloc count_malloc
+#define realloc count_realloc
+#define strdup count_strdup
+#define strndup count_strndup
+
+#include "../notification-osd.c"
+
+#undef malloc
+#undef realloc
+#undef strdup
+#undef strndup
+
+/* mpv */
+
+static char *chapter_title;
+
+const char *mpv_client_name(mpv_handle *ctx) { (void)ctx; return "notification_osd"; }
+int64_t mpv_client_id(mpv_handle *ctx) { (void)ctx; return 1; }
+void mpv_free(void *data) { free(data); }
+void mpv_free_node_contents(mpv_node *node) { (void)node; }
+int mpv_command(mpv_handle *ctx, const char **args) { (void)ctx; (void)args; return 0; }
+int mpv_command_node(mpv_handle *ctx, mpv_node *args, mpv_node *result) { (void)ctx; (void)args; (void)result; return -1; }
+int mpv_command_ret(mpv_handle *ctx, const char **args, mpv_node *result) { (void)ctx; (void)args; (void)result; return -1; }
+int mpv_command_async(mpv_handle *ctx, uint64_t ud, const char **args) { (void)ctx; (void)ud; (void)args; return 0; }
+int mpv_command_node_async(mpv_handle *ctx, uint64_t ud, mpv_node *args) { (void)ctx; (void)ud; (void)args; return 0; }
+void mpv_abort_async_command(mpv_handle *ctx, uint64_t ud) { (void)ctx; (void)ud; }
+int mpv_set_property(mpv_handle *ctx, const char *name, mpv_format format, void *data) { (void)ctx; (void)name; (void)format; (void)data; return 0; }
+int mpv_set_property_async(mpv_handle *ctx, uint64_t ud, const char *name, mpv_format format, void *data) { (void)ctx; (void)ud; (void)name; (void)format; (void)data; return 0; }
+int mpv_get_property(mpv_handle *ctx, const char *name, mpv_format format, void *data) { (void)ctx; (void)name; (void)format; (void)data; return MPV_ERROR_PROPERTY_UNAVAILABLE; }
+char *mpv_get_property_string(mpv_handle *ctx, const char *name) { (void)ctx; (void)name; return NULL; }
+int mpv_observe_property(mpv_handle *ctx, uint64_t ud, const char *name, mpv_format format) { (void)ctx; (void)ud; (void)name; (void)format; return 0; }
+int mpv_unobserve_property(mpv_handle *ctx, uint64_t ud) { (void)ctx; (void)ud; return 0; }
+mpv_event *mpv_wait_event(mpv_handle *ctx, double timeout) { (void)ctx; (void)timeout; static mpv_event none; return &none; }
+void mpv_set_wakeup_callback(mpv_handle *ctx, void (*cb)(void *d), void *d) { (void)ctx; (void)cb; (void)d; }
+const char *mpv_error_string(int error) { (void)error; return "error"; }
+int64_t mpv_get_time_us(mpv_handle *ctx) { (void)ctx; return 0; }
+int64_t mpv_get_time_ns(mpv_handle *ctx) { (void)ctx; return 0; }
+mpv_handle *mpv_create(void) { return NULL; }
+int mpv_initialize(mpv_handle *ctx) { (void)ctx; return -1; }
+void mpv_terminate_destroy(mpv_handle *ctx) { (void)ctx; }
+int mpv_set_option_string(mpv_handle *ctx, const char *name, const char *data) { (void)ctx; (void)name; (void)data; return 0; }
+int mpv_get_wakeup_pipe(mpv_handle *ctx) { (void)ctx; return -1; }
+
+char *mpv_get_property_osd_string(mpv_handle *ctx, const char *name)
+{
+    (void)ctx;
+    if (!strcmp(name, "chapter"))
+        return strdup(chapter_title);
+    if (!strcmp(name, "chapters"))
+        return strdup("500");
+    return NULL;
+}
+
+/* GLib and libnotify */
+
+void g_free(gpointer p) { free(p); }
+void g_list_free(GList *l) { (void)l; }
+void g_error_free(GError *e) { (void)e; }
+void g_object_unref(gpointer p) { (void)p; }
+GVariant *g_variant_new(const gchar *fmt, ...) { (void)fmt; return NULL; }
+GVariant *g_variant_new_fixed_array(const GVariantType *t, gconstpointer e, gsize n, gsize s) { (void)t; (void)e; (void)n; (void)s; return NULL; }
+GVariant *g_variant_new_from_data(const GVariantType *t, gconstpointer d, gsize s, gboolean trusted, GDestroyNotify n, gpointer u) { (void)t; (void)d; (void)s; (void)trusted; (void)n; (void)u; return NULL; }
+GVariant *g_variant_new_from_bytes(const GVariantType *t, GBytes *b, gboolean trusted) { (void)t; (void)b; (void)trusted; return NULL; }
+GBytes *g_bytes_new(gconstpointer d, gsize s) { (void)d; (void)s; return NULL; }
+GBytes *g_bytes_new_with_free_func(gconstpointer d, gsize s, GDestroyNotify f, gpointer u) { (void)d; (void)s; (void)f; (void)u; return NULL; }
+void g_bytes_unref(GBytes *b) { (void)b; }
+GVariant *g_variant_ref_sink(GVariant *v) { return v; }
+void g_variant_unref(GVariant *v) { (void)v; }
+GdkPixbuf *gdk_pixbuf_new_from_data(const guchar *data, GdkColorspace colorspace, gboolean has_alpha, int bits_per_sample, int width, int height, int rowstride, GdkPixbufDestroyNotify destroy_fn, gpointer destroy_fn_data) { (void)data; (void)colorspace; (void)has_alpha; (void)bits_per_sample; (void)width; (void)height; (void)rowstride; (void)destroy_fn; (void)destroy_fn_data; return NULL; }
+gboolean notify_init(const char *name) { (void)name; return 0; }
+void notify_uninit(void) {}
+gboolean notify_is_initted(void) { return 0; }
+GList *notify_get_server_caps(void) { return NULL; }
+gboolean notify_get_server_info(char **a, char **b, char **c, char **d) { (void)a; (void)b; (void)c; (void)d; return 0; }
+void notify_set_app_name(const char *name) { (void)name; }
+void notify_set_app_icon(const char *icon) { (void)icon; }
+NotifyNotification *notify_notification_new(const char *a, const char *b, const char *c) { (void)a; (void)b; (void)c; return NULL; }
+gboolean notify_notification_update(NotifyNotification *n, const char *a, const char *b, const char *c) { (void)n; (void)a; (void)b; (void)c; return 1; }
+gboolean notify_notification_show(NotifyNotification *n, GError **e) { (void)n; (void)e; return 1; }
+gboolean notify_notification_close(NotifyNotification *n, GError **e) { (void)n; (void)e; return 1; }
+void notify_notification_set_timeout(NotifyNotification *n, int t) { (void)n; (void)t; }
+void notify_notification_set_hint(NotifyNotification *n, const char *k, GVariant *v) { (void)n; (void)k; (void)v; }
+void notify_notification_set_category(NotifyNotification *n, const char *c) { (void)n; (void)c; }
+void notify_notification_set_urgency(NotifyNotification *n, NotifyUrgency u) { (void)n; (void)u; }
+void notify_notification_set_image_from_pixbuf(NotifyNotification *n, GdkPixbuf *p) { (void)n; (void)p; }
+
+/* the checks */
+
+/*
+ * generous, so that only a return to scanning whole inputs trips them. going
+ * through 100k metadata entries takes a few ms by itself
+ */
+#define MAX_CALL_NS (20 * NS_PER_MS)
+#define MAX_METADATA_NS (200 * NS_PER_MS)
+/* every saved field is at most FIELD_MAX_LEN bytes, escaped at most 6x */
+#define MAX_FIELD_BYTES (FIELD_MAX_LEN * 6 + 1)
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+        failures++; \
+    } \
+} while (0)
+
+struct measure {
+    int64_t start_ns;
+    int64_t calls;
+    int64_t bytes;
+};
+
+static struct measure measure_begin(void)
+{
+    return (struct measure){mono_ns(), allocs.calls, allocs.bytes};
+}
+
+static void measure_end(struct measure *m, const char *what, int64_t max_ns,
+        int64_t max_calls, int64_t max_bytes)
+{
+    int64_t ns = mono_ns() - m->start_ns;
+    int64_t calls = allocs.calls - m->calls;
+    int64_t bytes = allocs.bytes - m->bytes;
+    printf("%-16s %8" PRId64 " us %6" PRId64 " allocs %9" PRId64 " bytes\n",
+            what, ns / 1000, calls, bytes);
+    CHECK(ns <= max_ns, "%s took %" PRId64 " us", what, ns / 1000);
+    CHECK(calls <= max_calls, "%s made %" PRId64 " allocations", what, calls);
+    CHECK(bytes <= max_bytes, "%s allocated %" PRId64 " bytes", what, bytes);
+}
+
+static char *big_string(size_t size, const char *pattern)
+{
+    size_t len = strlen(pattern);
+    char *s = malloc(size + 1);
+    for (size_t i = 0; i < size; i++)
+        s[i] = pattern[i % len];
+    s[size] = '\0';
+    return s;
+}
+
+static void set_prop(enum observed_prop_userdata ud, mpv_format format,
+        void *data)
+{
+    mpv_event_property event_prop = {
+        .name = observed_props[ud].name,
+        .format = format,
+        .data = data,
+    };
+    mpv_event event = {
+        .event_id = MPV_EVENT_PROPERTY_CHANGE,
+        .reply_userdata = ud,
+        .data = &event_prop,
+    };
+    save_prop(&event, &observed_props[ud]);
+}
+
+int main(void)
+{
+    opts_copy(opts, opts_defaults);
+    /* markup is the case which escapes, and so allocates the most */
+    server_body_markup = true;
+
+    /* the escape of every byte of a multi-megabyte string */
+    char *amps = big_string(8 * 1024 * 1024, "&<>'\"");
+    struct measure m = measure_begin();
+    char *escaped = strdupesc(amps);
+    measure_end(&m, "strdupesc", MAX_CALL_NS, 1, MAX_FIELD_BYTES);
+    CHECK(escaped && strlen(escaped) < MAX_FIELD_BYTES, "strdupesc result too long");
+    free(escaped);
+
+    /* a multi-byte sequence at the cut isn't split */
+    char *utf8 = big_string(FIELD_MAX_LEN + 16, "\xe2\x96\xb6");
+    escaped = strdupesc(utf8);
+    CHECK(strlen(escaped) % 3 == 0, "strdupesc split a UTF-8 sequence");
+    free(escaped);
+    free(utf8);
+
+    /* 100k entry playlist */
+    int64_t count = 100000, pos = 99998;
+    char *loop = "inf";
+    m = measure_begin();
+    set_prop(P_PLAYLIST_COUNT, MPV_FORMAT_INT64, &count);
+    set_prop(P_PLAYLIST_POS, MPV_FORMAT_INT64, &pos);
+    set_prop(P_LOOP_PLAYLIST, MPV_FORMAT_STRING, &loop);
+    measure_end(&m, "playlist", MAX_CALL_NS, 1, 16);
+
+    /* a long subtitle line and media title */
+    char *sub_text = big_string(4 * 1024 * 1024, "a <i>subtitle</i> & ");
+    char *media_title = big_string(4 * 1024 * 1024, "title ");
+    m = measure_begin();
+    set_prop(P_SUB_TEXT, MPV_FORMAT_STRING, &sub_text);
+    set_prop(P_MEDIA_TITLE, MPV_FORMAT_STRING, &media_title);
+    measure_end(&m, "sub-text", MAX_CALL_NS, 2, 2 * MAX_FIELD_BYTES);
+
+    /* multi-megabyte tags among 100k metadata entries */
+    int num = 100000;
+    char *tag = big_string(2 * 1024 * 1024, "lyrics & <more> ");
+    static const char *big_keys[] = {
+        "artist", "title", "album", "album_artist", "date", "disc", "disctotal",
+    };
+    mpv_node *values = calloc(num, sizeof(*values));
+    char **keys = calloc(num, sizeof(*keys));
+    char (*filler_keys)[16] = calloc(num, sizeof(*filler_keys));
+    for (int i = 0; i < num; i++) {
+        if (i < (int)(sizeof(big_keys) / sizeof(big_keys[0]))) {
+            keys[i] = (char *)big_keys[i];
+        } else {
+            snprintf(filler_keys[i], sizeof(filler_keys[i]), "tag%d", i);
+            keys[i] = filler_keys[i];
+        }
+        values[i] = (mpv_node){.format = MPV_FORMAT_STRING, .u.string = tag};
+    }
+    mpv_node_list list = {.num = num, .values = values, .keys = keys};
+    mpv_node node = {.format = MPV_FORMAT_NODE_MAP, .u.list = &list};
+    mpv_event_property metadata_prop = {
+        .name = "metadata", .format = MPV_FORMAT_NODE, .data = &node,
+    };
+    m = measure_begin();
+    metadata_update(&metadata_prop);
+    measure_end(&m, "metadata", MAX_METADATA_NS, M_END, M_END * MAX_FIELD_BYTES);
+
+    /* hundreds of chapters, with a long title */
+    chapter_title = big_string(1024 * 1024, "chapter & ");
+    int64_t chapter = 499, chapters = 500;
+    m = measure_begin();
+    set_prop(P_CHAPTER, MPV_FORMAT_INT64, &chapter);
+    set_prop(P_CHAPTERS, MPV_FORMAT_INT64, &chapters);
+    get_osd_str_chapter();
+    measure_end(&m, "chapters", MAX_CALL_NS, 1, MAX_FIELD_BYTES);
+
+    /* composing the text doesn't allocate, whatever went into it */
+    m = measure_begin();
+    for (int i = 0; i < 100; i++) {
+        write_summary();
+        write_body();
+    }
+    measure_end(&m, "write x100", MAX_CALL_NS, 0, 0);
+    CHECK(strlen(body) < sizeof(body), "body overflowed");
+
+    free(chapter_title);
+    free(filler_keys);
+    free(keys);
+    free(values);
+    free(tag);
+    free(media_title);
+    free(sub_text);
+    free(amps);
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,7 @@
+/* minimal declarations for make check, see test/bounds.c */
+#pragma once
+#include <glib.h>
+typedef struct _GdkPixbuf GdkPixbuf;
+typedef enum { GDK_COLORSPACE_RGB } GdkColorspace;
+typedef void (*GdkPixbufDestroyNotify)(guchar *pixels, gpointer data);
+GdkPixbuf *gdk_pixbuf_new_from_data(const guchar *data, GdkColorspace colorspace, gboolean has_alpha, int bits_per_sample, int width, int height, int rowstride, GdkPixbufDestroyNotify destroy_fn, gpointer destroy_fn_data);
@@ -0,0 +1,22 @@
+/* minimal declarations for make check, see test/bounds.c */
+#pragma once
+#include <stddef.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+typedef int gboolean; typedef char gchar; typedef void *gpointer; typedef const void *gconstpointer; typedef unsigned char guchar; typedef size_t gsize; typedef int gint; typedef unsigned int guint;
+typedef struct _GList { gpointer data; struct _GList *next, *prev; } GList;
+typedef struct _GError { int domain; int code; gchar *message; } GError;
+typedef struct _GVariant GVariant; typedef struct _GVariantType GVariantType; typedef struct _GBytes GBytes;
+#define G_VARIANT_TYPE_BYTE ((const GVariantType *)"y")
+typedef void (*GDestroyNotify)(gpointer);
+void g_free(gpointer); void g_list_free(GList *); void g_error_free(GError *); void g_object_unref(gpointer);
+GVariant *g_variant_new(const gchar *fmt, ...);
+GVariant *g_variant_new_fixed_array(const GVariantType *t, gconstpointer e, gsize n, gsize s);
+GVariant *g_variant_new_from_data(const GVariantType *t, gconstpointer d, gsize s, gboolean trusted, GDestroyNotify n, gpointer u);
+GVariant *g_variant_new_from_bytes(const GVariantType *t, GBytes *b, gboolean trusted);
+GBytes *g_bytes_new(gconstpointer d, gsize s);
+GBytes *g_bytes_new_with_free_func(gconstpointer d, gsize s, GDestroyNotify f, gpointer u);
+void g_bytes_unref(GBytes *);
+GVariant *g_variant_ref_sink(GVariant *); void g_variant_unref(GVariant *);
+#define G_VARIANT_TYPE(s) ((const GVariantType *)(s))
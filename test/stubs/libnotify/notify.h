@@ -0,0 +1,20 @@
+/* minimal declarations for make check, see test/bounds.c */
+#pragma once
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+typedef struct _NotifyNotification NotifyNotification;
+typedef enum { NOTIFY_URGENCY_LOW, NOTIFY_URGENCY_NORMAL, NOTIFY_URGENCY_CRITICAL } NotifyUrgency;
+#define NOTIFY_EXPIRES_NEVER 0
+gboolean notify_init(const char *); void notify_uninit(void); gboolean notify_is_initted(void);
+GList *notify_get_server_caps(void);
+gboolean notify_get_server_info(char **, char **, char **, char **);
+void notify_set_app_name(const char *); void notify_set_app_icon(const char *);
+NotifyNotification *notify_notification_new(const char *, const char *, const char *);
+gboolean notify_notification_update(NotifyNotification *, const char *, const char *, const char *);
+gboolean notify_notification_show(NotifyNotification *, GError **);
+gboolean notify_notification_close(NotifyNotification *, GError **);
+void notify_notification_set_timeout(NotifyNotification *, int);
+void notify_notification_set_hint(NotifyNotification *, const char *, GVariant *);
+void notify_notification_set_category(NotifyNotification *, const char *);
+void notify_notification_set_urgency(NotifyNotification *, NotifyUrgency);
+void notify_notification_set_image_from_pixbuf(NotifyNotification *, GdkPixbuf *);